@@ -0,0 +1,105 @@
+#define _GNU_SOURCE // for sched_setaffinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "queue.h"
+
+// Microbenchmark for the cache line layout of Queue: producers and consumers pinned to different cores work on
+// opposite ends of the queue while a monitor thread keeps reading size() and visited().
+// Build it twice, with and without -DQUEUE_PACKED_LAYOUT, and compare the time per item and the cache misses
+// reported by perf (see to_do.txt). Needs at least 2 cores to show anything.
+
+#define DEFAULT_ITEMS 20000000L
+
+static long items_per_producer;
+static atomic_bool running;
+static atomic_long monitor_reads;
+
+// Helper function to pin the calling thread to a core, if there is such a core
+void pin_to_core(int core) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % CPU_SETSIZE, &set);
+    sched_setaffinity(0, sizeof(set), &set); // failing only means the thread isn't pinned
+}
+
+double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int producer(void *arg) {
+    pin_to_core((int)(long)arg);
+    for (long i = 1; i <= items_per_producer; ++i) {
+        enqueue((void *)i);
+    }
+    return 0;
+}
+
+int consumer(void *arg) {
+    pin_to_core((int)(long)arg);
+    void *item;
+    // polling with tryDequeue so that the consumer never parks and only the item storage and counters are measured
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (!tryDequeue(&item)) {
+            thrd_yield();
+        }
+    }
+    return 0;
+}
+
+int monitor(void *arg) {
+    pin_to_core((int)(long)arg);
+    long reads = 0;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        reads += (long)(size() + visited() > 0);
+    }
+    atomic_store(&monitor_reads, reads);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int num_producers = argc > 1 ? atoi(argv[1]) : 1;
+    int num_consumers = argc > 2 ? atoi(argv[2]) : 1;
+    long total_items = argc > 3 ? atol(argv[3]) : DEFAULT_ITEMS;
+    items_per_producer = total_items / num_producers;
+    total_items = items_per_producer * num_producers;
+
+    initQueue();
+    atomic_store(&running, true);
+
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    thrd_t producers[num_producers];
+    thrd_t consumers[num_consumers];
+    thrd_t monitor_thread;
+    int core = 0;
+    for (int i = 0; i < num_producers; ++i) {
+        thrd_create(&producers[i], producer, (void *)(long)core++);
+    }
+    for (int i = 0; i < num_consumers; ++i) {
+        thrd_create(&consumers[i], consumer, (void *)(long)core++);
+    }
+    thrd_create(&monitor_thread, monitor, (void *)(long)core++);
+
+    for (int i = 0; i < num_producers; ++i) {
+        thrd_join(producers[i], NULL);
+    }
+    while (visited() < (size_t)total_items) {
+        thrd_yield();
+    }
+    double elapsed = seconds_since(&start);
+    atomic_store(&running, false);
+    for (int i = 0; i < num_consumers; ++i) {
+        thrd_join(consumers[i], NULL);
+    }
+    thrd_join(monitor_thread, NULL);
+
+    printf("producers=%d consumers=%d items=%ld time=%.3fs ns/item=%.1f monitor_reads=%ld\n",
+           num_producers, num_consumers, total_items, elapsed, elapsed * 1e9 / total_items, atomic_load(&monitor_reads));
+    destroyQueue();
+    return 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Head to head comparison of the implementations of queue.h: queue.c, dont_touch.c, monet1.c and monet2.c.
+# Every implementation is compiled on its own, then objcopy renames its queue.h functions to cmp_<impl>_<function>
+# and makes all of its other symbols local, so the four can be linked into a single queue_bench without clashing.
+# The same workload is run against each of them (each in its own process, so one that hangs doesn't stop the others),
+# and a table of ops/sec per configuration is printed from the combined CSV.
+#
+# usage: ./compare_queues.sh [max_producers] [max_consumers] [items_per_run] [repetitions]
+set -e
+cd "$(dirname "$0")"
+
+CC=${CC:-gcc}
+CFLAGS="-O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread"
+IMPLS="queue dont_touch monet1 monet2"
+API="initQueue destroyQueue enqueue dequeue tryDequeue size waiting visited"
+BUILD=compare_build
+mkdir -p $BUILD
+
+objs=""
+for impl in $IMPLS; do
+    keep=""
+    rename=""
+    for f in $API; do
+        keep="$keep --keep-global-symbol=$f"
+        rename="$rename --redefine-sym $f=cmp_${impl}_$f"
+    done
+    $CC $CFLAGS -c $impl.c -o $BUILD/$impl.full.o
+    objcopy $keep $BUILD/$impl.full.o $BUILD/$impl.local.o
+    objcopy $rename $BUILD/$impl.local.o $BUILD/$impl.o
+    objs="$objs $BUILD/$impl.o"
+done
+$CC $CFLAGS -DQUEUE_BENCH_COMPARE queue_bench.c $objs -o $BUILD/queue_compare
+
+results=$BUILD/results.csv
+for impl in $IMPLS; do
+    $BUILD/queue_compare $impl "$@" > $BUILD/$impl.csv || echo "$impl stopped early, see the status column of $BUILD/$impl.csv" >&2
+done
+# the header of the first file, then the rows of all of them
+{ head -n 1 $BUILD/queue.csv; for impl in $IMPLS; do tail -n +2 $BUILD/$impl.csv; done; } > $results
+
+# mean ops/sec over the repetitions of every configuration, one column per implementation
+awk -F, -v impls="$IMPLS" '
+NR > 1 {
+    key = sprintf("%-9s %-9s %-6s %-5s", $2, $3, $4, $5)
+    if (!(key in seen)) { seen[key] = 1; order[++nkeys] = key }
+    if ($14 == "ok") { sum[key, $1] += $9; runs[key, $1]++ }
+    else { failed[key, $1] = $14 }
+}
+END {
+    n = split(impls, names, " ")
+    printf "%-9s %-9s %-6s %-5s", "producers", "consumers", "pattern", "queue"
+    for (i = 1; i <= n; i++) printf " %14s", names[i]
+    printf "\n"
+    for (k = 1; k <= nkeys; k++) {
+        printf "%s", order[k]
+        for (i = 1; i <= n; i++) {
+            if ((order[k], names[i]) in runs) printf " %14.0f", sum[order[k], names[i]] / runs[order[k], names[i]]
+            else if ((order[k], names[i]) in failed) printf " %14s", failed[order[k], names[i]]
+            else printf " %14s", "-"
+        }
+        printf "\n"
+    }
+}' $results
+echo "all runs (with latency percentiles): $results"
@@ -0,0 +1,914 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include "queue.h"
+
+// Tests for the additions to the queue.h API (everything beyond the functions of the assignment)
+
+#define NUM_WAITERS 3
+
+static atomic_long wakeup_data[NUM_WAITERS];
+
+// Helper function to print test results
+void print_result(const char *test_name, bool result) {
+    printf("%s: %s\n", test_name, result ? "PASSED" : "FAILED");
+}
+
+// Helper function to let other threads reach their blocking call
+void short_sleep(void) {
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
+}
+
+int dequeue_into_slot(void *arg) {
+    long id = (long)arg;
+    atomic_store(&wakeup_data[id], (long)dequeue());
+    return 0;
+}
+
+// Function to test that a burst keeps its order
+void test_enqueue_many_order() {
+    initQueue();
+
+    const int num_items = 1000;
+    void *items[num_items];
+    for (int i = 0; i < num_items; ++i) {
+        items[i] = (void *)(long)(i + 1);
+    }
+    enqueue((void *)(long)0);
+    enqueueMany(items, num_items);
+    enqueueMany(items, 0);
+    print_result("enqueueMany - Size", size() == (size_t)num_items + 1);
+
+    bool fifo_order = true;
+    for (int i = 0; i <= num_items; ++i) {
+        if ((long)dequeue() != i) {
+            fifo_order = false;
+            break;
+        }
+    }
+    print_result("enqueueMany - FIFO order", fifo_order);
+    print_result("enqueueMany - Visited", visited() == (size_t)num_items + 1);
+
+    destroyQueue();
+}
+
+// Function to test that a burst is handed to waiting threads in the order they started waiting
+void test_enqueue_many_wakes_waiters() {
+    initQueue();
+
+    thrd_t threads[NUM_WAITERS];
+    for (long i = 0; i < NUM_WAITERS; ++i) {
+        thrd_create(&threads[i], dequeue_into_slot, (void *)i);
+        short_sleep();
+    }
+    print_result("enqueueMany - Waiting before burst", waiting() == NUM_WAITERS);
+
+    void *items[NUM_WAITERS + 2];
+    for (int i = 0; i < NUM_WAITERS + 2; ++i) {
+        items[i] = (void *)(long)(i + 1);
+    }
+    enqueueMany(items, NUM_WAITERS + 2);
+    for (int i = 0; i < NUM_WAITERS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+
+    bool correct_order = true;
+    for (int i = 0; i < NUM_WAITERS; ++i) {
+        if (atomic_load(&wakeup_data[i]) != i + 1) {
+            correct_order = false;
+        }
+    }
+    print_result("enqueueMany - Waiters served in FIFO order", correct_order);
+    print_result("enqueueMany - Rest of burst stays queued", size() == 2 && waiting() == 0);
+
+    destroyQueue();
+}
+
+int dequeue_many_into_slot(void *arg) {
+    long id = (long)arg;
+    void *items[4];
+    size_t n = dequeueMany(items, 4);
+    atomic_store(&wakeup_data[id], n == 1 ? (long)items[0] : -1);
+    return 0;
+}
+
+// Function to test taking several items at once
+void test_dequeue_many() {
+    initQueue();
+
+    void *items[10];
+    void *out[10];
+    for (int i = 0; i < 10; ++i) {
+        items[i] = (void *)(long)(i + 1);
+    }
+    print_result("tryDequeueMany - Empty queue", tryDequeueMany(out, 10) == 0);
+    enqueueMany(items, 10);
+
+    size_t n = tryDequeueMany(out, 4);
+    bool correct = n == 4;
+    for (size_t i = 0; i < n; ++i) {
+        correct = correct && (long)out[i] == (long)i + 1;
+    }
+    print_result("tryDequeueMany - Takes up to max in order", correct);
+    print_result("tryDequeueMany - Size and visited", size() == 6 && visited() == 4);
+
+    n = dequeueMany(out, 10);
+    correct = n == 6;
+    for (size_t i = 0; i < n; ++i) {
+        correct = correct && (long)out[i] == (long)i + 5;
+    }
+    print_result("dequeueMany - Takes what is there", correct);
+    print_result("dequeueMany - Size and visited", size() == 0 && visited() == 10);
+
+    destroyQueue();
+}
+
+// Function to test that dequeueMany blocks until an item arrives
+void test_dequeue_many_blocks() {
+    initQueue();
+
+    thrd_t thread;
+    thrd_create(&thread, dequeue_many_into_slot, (void *)0);
+    short_sleep();
+    print_result("dequeueMany - Blocks on empty queue", waiting() == 1);
+
+    enqueue((void *)(long)7);
+    thrd_join(thread, NULL);
+    print_result("dequeueMany - Woken with the item", atomic_load(&wakeup_data[0]) == 7 && visited() == 1);
+
+    destroyQueue();
+}
+
+// Helper function to get a deadline ms milliseconds from now
+struct timespec deadline_in_ms(long ms) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+int enqueue_blocking(void *arg) {
+    enqueue(arg);
+    return 0;
+}
+
+// Function to test bounded mode
+void test_bounded() {
+    initQueueBounded(2);
+
+    print_result("Bounded - tryEnqueue with free slots", tryEnqueue((void *)(long)1) && tryEnqueue((void *)(long)2));
+    print_result("Bounded - tryEnqueue when full", !tryEnqueue((void *)(long)3));
+    struct timespec deadline = deadline_in_ms(50);
+    print_result("Bounded - enqueueTimed times out when full", !enqueueTimed((void *)(long)3, &deadline));
+
+    // producers that find the queue full wait in FIFO order
+    thrd_t threads[NUM_WAITERS];
+    for (long i = 0; i < NUM_WAITERS; ++i) {
+        thrd_create(&threads[i], enqueue_blocking, (void *)(i + 3));
+        short_sleep();
+    }
+    print_result("Bounded - Producers blocked", size() == 2);
+
+    bool fifo_order = true;
+    for (long i = 1; i <= NUM_WAITERS + 2; ++i) {
+        if ((long)dequeue() != i) {
+            fifo_order = false;
+        }
+        short_sleep();
+        if (size() > 2) {
+            fifo_order = false;
+        }
+    }
+    for (int i = 0; i < NUM_WAITERS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    print_result("Bounded - Blocked producers get slots in FIFO order", fifo_order);
+
+    deadline = deadline_in_ms(50);
+    print_result("Bounded - enqueueTimed with a free slot", enqueueTimed((void *)(long)9, &deadline) && (long)dequeue() == 9);
+
+    destroyQueue();
+}
+
+int dequeue_timed_into_slot(void *arg) {
+    long id = (long)arg;
+    void *item;
+    struct timespec deadline = deadline_in_ms(150);
+    atomic_store(&wakeup_data[id], dequeueTimed(&item, &deadline) ? (long)item : -1);
+    return 0;
+}
+
+// Function to test dequeue with a deadline
+void test_dequeue_timed() {
+    initQueue();
+
+    void *item;
+    struct timespec deadline = deadline_in_ms(50);
+    print_result("dequeueTimed - Times out on empty queue", !dequeueTimed(&item, &deadline) && waiting() == 0);
+
+    enqueue((void *)(long)5);
+    deadline = deadline_in_ms(50);
+    print_result("dequeueTimed - Takes an available item", dequeueTimed(&item, &deadline) && (long)item == 5);
+
+    // the middle one of three waiting threads times out, the other two must still be served in order
+    thrd_t threads[NUM_WAITERS];
+    thrd_create(&threads[0], dequeue_into_slot, (void *)0);
+    short_sleep();
+    thrd_create(&threads[1], dequeue_timed_into_slot, (void *)1);
+    short_sleep();
+    thrd_create(&threads[2], dequeue_into_slot, (void *)2);
+    thrd_join(threads[1], NULL);
+    print_result("dequeueTimed - Timed out thread left th_queue", atomic_load(&wakeup_data[1]) == -1 && waiting() == 2);
+
+    enqueue((void *)(long)1);
+    enqueue((void *)(long)2);
+    thrd_join(threads[0], NULL);
+    thrd_join(threads[2], NULL);
+    print_result("dequeueTimed - Remaining waiters served in order",
+                 atomic_load(&wakeup_data[0]) == 1 && atomic_load(&wakeup_data[2]) == 2 && size() == 0);
+
+    destroyQueue();
+}
+
+int dequeue_from_queue(void *arg) {
+    queue_t *q = (queue_t *)arg;
+    atomic_store(&wakeup_data[0], (long)queue_dequeue(q));
+    return 0;
+}
+
+// Function to test that queues made by queue_create are independent of each other and of the global queue
+void test_instances() {
+    initQueue();
+    queue_t *q1 = queue_create();
+    queue_t *q2 = queue_create_bounded(1);
+
+    enqueue((void *)(long)1);
+    queue_enqueue(q1, (void *)(long)2);
+    queue_enqueue(q1, (void *)(long)3);
+    print_result("Instances - Separate sizes", size() == 1 && queue_size(q1) == 2 && queue_size(q2) == 0);
+    print_result("Instances - Separate capacities", queue_try_enqueue(q2, (void *)(long)4) && !queue_try_enqueue(q2, (void *)(long)5));
+
+    void *item;
+    print_result("Instances - Separate items", (long)dequeue() == 1 && !tryDequeue(&item) &&
+                 queue_try_dequeue(q1, &item) && (long)item == 2 && (long)queue_dequeue(q2) == 4);
+
+    thrd_t thread;
+    thrd_create(&thread, dequeue_from_queue, q2);
+    short_sleep();
+    print_result("Instances - Separate waiting threads", queue_waiting(q2) == 1 && queue_waiting(q1) == 0 && waiting() == 0);
+    queue_enqueue(q2, (void *)(long)6);
+    thrd_join(thread, NULL);
+    print_result("Instances - Separate visited", atomic_load(&wakeup_data[0]) == 6 && queue_visited(q2) == 2 &&
+                 queue_visited(q1) == 1 && visited() == 1);
+
+    queue_destroy(q1);
+    queue_destroy(q2);
+    destroyQueue();
+}
+
+#define NUM_SHARD_PRODUCERS 4
+#define ITEMS_PER_SHARD_PRODUCER 10000
+
+int produce_into_queue(void *arg) {
+    queue_t *q = (queue_t *)arg;
+    static atomic_long next_producer;
+    long id = atomic_fetch_add(&next_producer, 1) % NUM_SHARD_PRODUCERS;
+    for (long i = 0; i < ITEMS_PER_SHARD_PRODUCER; ++i) {
+        queue_enqueue(q, (void *)(id * ITEMS_PER_SHARD_PRODUCER + i + 1));
+    }
+    return 0;
+}
+
+// Function to test that a sharded queue delivers everything, keeps each producer's order and wakes waiters of any shard
+void test_sharded() {
+    queue_t *q = queue_create_sharded(NUM_SHARD_PRODUCERS);
+
+    thrd_t threads[NUM_SHARD_PRODUCERS];
+    for (int i = 0; i < NUM_SHARD_PRODUCERS; ++i) {
+        thrd_create(&threads[i], produce_into_queue, q);
+    }
+    for (int i = 0; i < NUM_SHARD_PRODUCERS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    print_result("Sharded - Size sums the shards", queue_size(q) == NUM_SHARD_PRODUCERS * ITEMS_PER_SHARD_PRODUCER);
+
+    // this thread steals from every shard, each producer's items must still come out in order
+    long last[NUM_SHARD_PRODUCERS] = {0};
+    bool per_producer_order = true;
+    void *item;
+    while (queue_try_dequeue(q, &item)) {
+        long id = ((long)item - 1) / ITEMS_PER_SHARD_PRODUCER;
+        per_producer_order = per_producer_order && (long)item > last[id];
+        last[id] = (long)item;
+    }
+    for (int i = 0; i < NUM_SHARD_PRODUCERS; ++i) {
+        per_producer_order = per_producer_order && last[i] == (long)(i + 1) * ITEMS_PER_SHARD_PRODUCER;
+    }
+    print_result("Sharded - All items in per-producer order", per_producer_order);
+    print_result("Sharded - Visited sums the shards",
+                 queue_size(q) == 0 && queue_visited(q) == NUM_SHARD_PRODUCERS * ITEMS_PER_SHARD_PRODUCER);
+
+    thrd_t thread;
+    thrd_create(&thread, dequeue_from_queue, q);
+    short_sleep();
+    print_result("Sharded - Blocks when every shard is empty", queue_waiting(q) == 1);
+    queue_enqueue(q, (void *)(long)8);
+    thrd_join(thread, NULL);
+    print_result("Sharded - Woken by an item on another shard", atomic_load(&wakeup_data[0]) == 8);
+
+    queue_destroy(q);
+}
+
+int enqueue_after_sleep(void *arg) {
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 1000}, NULL);
+    enqueue(arg);
+    return 0;
+}
+
+// Function to test that dequeue works with spinning disabled and with a large spin limit
+void test_spin_limit() {
+    initQueue();
+
+    setSpinLimit(0);
+    thrd_t thread;
+    thrd_create(&thread, dequeue_into_slot, (void *)0);
+    short_sleep();
+    print_result("Spin - Parks right away with spinning disabled", waiting() == 1);
+    enqueue((void *)(long)3);
+    thrd_join(thread, NULL);
+    print_result("Spin - Parked thread gets the item", atomic_load(&wakeup_data[0]) == 3);
+
+    setSpinLimit(1000000);
+    bool all_received = true;
+    for (long i = 1; i <= 100; ++i) {
+        thrd_create(&thread, enqueue_after_sleep, (void *)i);
+        all_received = all_received && (long)dequeue() == i;
+        thrd_join(thread, NULL);
+    }
+    print_result("Spin - Items that arrive shortly after are received", all_received && waiting() == 0 && visited() == 101);
+
+    destroyQueue();
+}
+
+#define NUM_BARGING_THREADS 4
+#define ITEMS_PER_BARGING_THREAD 50000
+
+static atomic_long barging_sum;
+
+int produce_for_barging(void *arg) {
+    queue_t *q = (queue_t *)arg;
+    for (long i = 1; i <= ITEMS_PER_BARGING_THREAD; ++i) {
+        queue_enqueue(q, (void *)i);
+        if (i % 1000 == 0) {
+            thrd_yield(); // lets the consumers run dry and park now and then
+        }
+    }
+    return 0;
+}
+
+int consume_for_barging(void *arg) {
+    queue_t *q = (queue_t *)arg;
+    long sum = 0;
+    for (long i = 1; i <= ITEMS_PER_BARGING_THREAD; ++i) {
+        sum += (long)queue_dequeue(q);
+    }
+    atomic_fetch_add(&barging_sum, sum);
+    return 0;
+}
+
+// Function to test that in barging mode parked threads still get items and nothing is lost or handed out twice
+void test_barging() {
+    queue_t *q = queue_create();
+    queue_set_policy(q, QUEUE_BARGING);
+
+    queue_set_spin_limit(q, 0);
+    thrd_t thread;
+    thrd_create(&thread, dequeue_from_queue, q);
+    short_sleep();
+    queue_enqueue(q, (void *)(long)9);
+    thrd_join(thread, NULL);
+    print_result("Barging - Parked thread gets an item nobody running takes", atomic_load(&wakeup_data[0]) == 9);
+
+    // consumers that spin, take items right away and park all at once (every consumer must get all of its items to finish)
+    queue_set_spin_limit(q, 2048);
+    thrd_t producers[NUM_BARGING_THREADS];
+    thrd_t consumers[NUM_BARGING_THREADS];
+    atomic_store(&barging_sum, 0);
+    for (int i = 0; i < NUM_BARGING_THREADS; ++i) {
+        thrd_create(&consumers[i], consume_for_barging, q);
+    }
+    for (int i = 0; i < NUM_BARGING_THREADS; ++i) {
+        thrd_create(&producers[i], produce_for_barging, q);
+    }
+    for (int i = 0; i < NUM_BARGING_THREADS; ++i) {
+        thrd_join(producers[i], NULL);
+        thrd_join(consumers[i], NULL);
+    }
+    long expected = NUM_BARGING_THREADS * (long)ITEMS_PER_BARGING_THREAD * (ITEMS_PER_BARGING_THREAD + 1) / 2;
+    print_result("Barging - Every item delivered exactly once",
+                 atomic_load(&barging_sum) == expected && queue_size(q) == 0 && queue_waiting(q) == 0);
+
+    queue_destroy(q);
+}
+
+// Function to test that priority mode takes from the highest non-empty level first, in FIFO order within a level
+void test_priority() {
+    queue_t *q = queue_create_priority(4);
+
+    for (long i = 1; i <= 3; ++i) {
+        queue_enqueue(q, (void *)i); // level 0
+        queue_enqueue_priority(q, (void *)(10 + i), 3);
+        queue_enqueue_priority(q, (void *)(20 + i), 1);
+    }
+    long expected[] = {11, 12, 13, 21, 22, 23, 1, 2, 3};
+    bool in_order = queue_size(q) == 9;
+    for (int i = 0; i < 9; ++i) {
+        in_order = in_order && (long)queue_dequeue(q) == expected[i];
+    }
+    print_result("Priority - Highest level first, FIFO within a level", in_order && queue_size(q) == 0);
+
+    queue_enqueue_priority(q, (void *)(long)1, 0);
+    queue_enqueue_priority(q, (void *)(long)2, 99); // clamped to the top level
+    void *item;
+    print_result("Priority - TryDequeue takes the top level, levels past the top are clamped",
+                 queue_try_dequeue(q, &item) && (long)item == 2 && queue_try_dequeue(q, &item) && (long)item == 1 &&
+                 !queue_try_dequeue(q, &item));
+
+    // with aging every other take goes to a lower level, so the low item can't wait for all the high ones
+    queue_set_aging(q, 2);
+    queue_enqueue_priority(q, (void *)(long)1, 0);
+    for (long i = 1; i <= 20; ++i) {
+        queue_enqueue_priority(q, (void *)(100 + i), 3);
+    }
+    int position = 0;
+    for (int i = 1; i <= 21; ++i) {
+        if ((long)queue_dequeue(q) == 1) {
+            position = i;
+        }
+    }
+    print_result("Priority - Aging lets a low level through", position > 0 && position < 21 && queue_visited(q) == 32);
+
+    // takes are counted per queue, so aging works even if every take is made by a different thread
+    thrd_t thread;
+    queue_enqueue_priority(q, (void *)(long)1, 0);
+    for (long i = 1; i <= 20; ++i) {
+        queue_enqueue_priority(q, (void *)(100 + i), 3);
+    }
+    position = 0;
+    for (int i = 1; i <= 21; ++i) {
+        thrd_create(&thread, dequeue_from_queue, q);
+        thrd_join(thread, NULL);
+        if (atomic_load(&wakeup_data[0]) == 1) {
+            position = i;
+        }
+    }
+    print_result("Priority - Aging counts the takes of all threads", position > 0 && position < 21);
+
+    thrd_create(&thread, dequeue_from_queue, q);
+    short_sleep();
+    queue_enqueue_priority(q, (void *)(long)7, 2);
+    thrd_join(thread, NULL);
+    print_result("Priority - Waiting thread gets an item of any level", atomic_load(&wakeup_data[0]) == 7);
+
+    queue_destroy(q);
+}
+
+#define NUM_SCHEDULED 100000
+
+// Helper function to return the TIME_UTC time ms milliseconds from now
+struct timespec in_ms(long ms) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    ts.tv_sec += ms / 1000 + ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    return ts;
+}
+
+long ms_since(const struct timespec *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Function to test that scheduled items show up only once they are due, in the order they are due
+void test_scheduled() {
+    queue_t *q = queue_create();
+    void *item;
+
+    queue_enqueue_after(q, (void *)(long)1, &(struct timespec){.tv_sec = 0, .tv_nsec = 50000000});
+    print_result("Scheduled - Not visible before it is due", !queue_try_dequeue(q, &item) && queue_size(q) == 0);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 80000000}, NULL);
+    print_result("Scheduled - Visible once it is due", queue_try_dequeue(q, &item) && (long)item == 1);
+
+    struct timespec past = in_ms(-10);
+    queue_enqueue_at(q, (void *)(long)2, &past);
+    print_result("Scheduled - Due right away when its time has passed", queue_try_dequeue(q, &item) && (long)item == 2);
+
+    // a parked thread wakes up on its own when the item is due, and items come out in the order they are due
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    thrd_t thread;
+    thrd_create(&thread, dequeue_from_queue, q);
+    struct timespec at30 = in_ms(30), at10 = in_ms(10), at20 = in_ms(20), at90 = in_ms(90);
+    queue_enqueue_at(q, (void *)(long)30, &at30);
+    queue_enqueue_at(q, (void *)(long)90, &at90);
+    queue_enqueue_at(q, (void *)(long)10, &at10);
+    queue_enqueue_at(q, (void *)(long)20, &at20);
+    thrd_join(thread, NULL);
+    bool first_on_time = atomic_load(&wakeup_data[0]) == 10 && ms_since(&start) >= 10;
+    bool in_order = (long)queue_dequeue(q) == 20 && (long)queue_dequeue(q) == 30 && (long)queue_dequeue(q) == 90;
+    print_result("Scheduled - Parked thread wakes up when the first one is due", first_on_time);
+    print_result("Scheduled - Come out in the order they are due", in_order && ms_since(&start) >= 90);
+
+    // many pending items, spread over a few levels of the wheel, and some far ahead that are dropped by destroy
+    for (long i = 1; i <= NUM_SCHEDULED; ++i) {
+        struct timespec when = in_ms(i % 300);
+        queue_enqueue_at(q, (void *)i, &when);
+    }
+    for (long i = 1; i <= 1000; ++i) {
+        queue_enqueue_after(q, (void *)i, &(struct timespec){.tv_sec = 3600 * i, .tv_nsec = 0});
+    }
+    long sum = 0;
+    for (long i = 1; i <= NUM_SCHEDULED; ++i) {
+        sum += (long)queue_dequeue(q);
+    }
+    print_result("Scheduled - Every one of many is delivered",
+                 sum == (long)NUM_SCHEDULED * (NUM_SCHEDULED + 1) / 2 && !queue_try_dequeue(q, &item));
+
+    queue_destroy(q);
+}
+
+int dequeue_tag_into_slot(void *arg) {
+    long id = (long)arg;
+    atomic_store(&wakeup_data[id], (long)dequeueTag((uint32_t)id + 1));
+    return 0;
+}
+
+// Function to test that tagged items only go to consumers of their tag, in FIFO order within a tag
+void test_tagged() {
+    initQueue();
+    void *item;
+
+    enqueueTagged((void *)(long)11, 1);
+    enqueueTagged((void *)(long)21, 2);
+    enqueueTagged((void *)(long)12, 1);
+    enqueue((void *)(long)5);
+    print_result("Tagged - Counted by size", size() == 4);
+    print_result("Tagged - Dequeue only sees untagged items", (long)dequeue() == 5 && !tryDequeue(&item));
+    print_result("Tagged - FIFO within a tag", (long)dequeueTag(1) == 11 && tryDequeueTag(1, &item) && (long)item == 12 &&
+                 !tryDequeueTag(1, &item) && item == NULL);
+    print_result("Tagged - Other tags are left alone", (long)dequeueTag(2) == 21 && !tryDequeueTag(3, &item) && size() == 0);
+
+    // every thread waits for a tag of its own, an item wakes only the thread waiting for its tag
+    thrd_t threads[NUM_WAITERS];
+    for (long i = 0; i < NUM_WAITERS; ++i) {
+        atomic_store(&wakeup_data[i], 0);
+        thrd_create(&threads[i], dequeue_tag_into_slot, (void *)i);
+    }
+    short_sleep();
+    print_result("Tagged - Waiting threads are counted", waiting() == NUM_WAITERS);
+    enqueueTagged((void *)(long)33, 3);
+    thrd_join(threads[2], NULL);
+    short_sleep();
+    print_result("Tagged - Only the thread waiting for the tag wakes up", atomic_load(&wakeup_data[2]) == 33 &&
+                 atomic_load(&wakeup_data[0]) == 0 && atomic_load(&wakeup_data[1]) == 0 && waiting() == 2);
+    enqueue((void *)(long)6); // an untagged item wakes none of them either
+    enqueueTagged((void *)(long)22, 2);
+    enqueueTagged((void *)(long)11, 1);
+    thrd_join(threads[0], NULL);
+    thrd_join(threads[1], NULL);
+    print_result("Tagged - Every waiting thread gets an item of its tag", atomic_load(&wakeup_data[0]) == 11 &&
+                 atomic_load(&wakeup_data[1]) == 22 && waiting() == 0 && size() == 1 && visited() == 7);
+
+    destroyQueue();
+}
+
+#define NUM_TAGS 20000
+
+// Function to test that tags which only differ in their high bits are spread over the tag table
+// (with a hash that ignores them, every lookup walks past all the other tags under the queue lock)
+void test_tagged_high_bits() {
+    initQueue();
+    void *item;
+
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    for (uint32_t i = 1; i <= NUM_TAGS; ++i) {
+        enqueueTagged((void *)(long)i, i << 16);
+    }
+    bool all_found = true;
+    for (uint32_t i = NUM_TAGS; i >= 1; --i) {
+        if (!tryDequeueTag(i << 16, &item) || (long)item != (long)i) {
+            all_found = false;
+        }
+    }
+    long elapsed = ms_since(&start);
+    print_result("Tagged - Tags differing in high bits", all_found && size() == 0);
+    print_result("Tagged - Tags differing in high bits are spread out", elapsed < 300);
+
+    destroyQueue();
+}
+
+#define ANY_QUEUES 3
+#define ANY_ITEMS 20000
+
+static queue_t *any_queues[ANY_QUEUES];
+static atomic_long any_sum;
+
+int dequeue_any_into_slot(void *arg) {
+    (void)arg;
+    size_t which = ANY_QUEUES;
+    atomic_store(&wakeup_data[0], (long)dequeueAny(any_queues, ANY_QUEUES, &which));
+    atomic_store(&wakeup_data[1], (long)which);
+    return 0;
+}
+
+int produce_for_any(void *arg) {
+    long id = (long)arg;
+    for (long i = 1; i <= ANY_ITEMS; ++i) {
+        queue_enqueue(any_queues[(i + id) % ANY_QUEUES], (void *)i);
+    }
+    return 0;
+}
+
+int consume_for_any(void *arg) {
+    (void)arg;
+    size_t which;
+    for (long i = 1; i <= ANY_ITEMS; ++i) {
+        atomic_fetch_add(&any_sum, (long)dequeueAny(any_queues, ANY_QUEUES, &which));
+    }
+    return 0;
+}
+
+// Function to test waiting on several queues at once
+void test_dequeue_any() {
+    for (int i = 0; i < ANY_QUEUES; ++i) {
+        any_queues[i] = queue_create();
+    }
+    size_t which = ANY_QUEUES;
+
+    queue_enqueue(any_queues[2], (void *)(long)7);
+    queue_enqueue(any_queues[1], (void *)(long)8);
+    print_result("dequeueAny - Takes an item that is there already, first queue first",
+                 (long)dequeueAny(any_queues, ANY_QUEUES, &which) == 8 && which == 1 &&
+                 (long)dequeueAny(any_queues, ANY_QUEUES, &which) == 7 && which == 2);
+
+    // the thread waits in every queue, and only the one that gets an item hands it over
+    thrd_t thread;
+    atomic_store(&wakeup_data[0], 0);
+    thrd_create(&thread, dequeue_any_into_slot, NULL);
+    short_sleep();
+    print_result("dequeueAny - Waits in every queue", queue_waiting(any_queues[0]) == 1 &&
+                 queue_waiting(any_queues[1]) == 1 && queue_waiting(any_queues[2]) == 1);
+    queue_enqueue(any_queues[2], (void *)(long)42);
+    thrd_join(thread, NULL);
+    print_result("dequeueAny - Woken by the queue that got an item", atomic_load(&wakeup_data[0]) == 42 &&
+                 atomic_load(&wakeup_data[1]) == 2);
+    queue_enqueue(any_queues[0], (void *)(long)43);
+    print_result("dequeueAny - Leaves the other queues", queue_waiting(any_queues[0]) == 0 &&
+                 queue_waiting(any_queues[1]) == 0 && queue_waiting(any_queues[2]) == 0 &&
+                 queue_size(any_queues[0]) == 1 && (long)queue_dequeue(any_queues[0]) == 43);
+
+    // with items going to all queues at once, every item is delivered exactly once
+    thrd_t producers[2], consumers[2];
+    atomic_store(&any_sum, 0);
+    for (long i = 0; i < 2; ++i) {
+        thrd_create(&consumers[i], consume_for_any, NULL);
+        thrd_create(&producers[i], produce_for_any, (void *)i);
+    }
+    for (int i = 0; i < 2; ++i) {
+        thrd_join(producers[i], NULL);
+        thrd_join(consumers[i], NULL);
+    }
+    bool empty = true;
+    for (int i = 0; i < ANY_QUEUES; ++i) {
+        empty = empty && queue_size(any_queues[i]) == 0 && queue_waiting(any_queues[i]) == 0;
+    }
+    print_result("dequeueAny - No item lost or delivered twice",
+                 atomic_load(&any_sum) == 2L * ANY_ITEMS * (ANY_ITEMS + 1) / 2 && empty);
+
+    for (int i = 0; i < ANY_QUEUES; ++i) {
+        queue_destroy(any_queues[i]);
+    }
+}
+
+// Function to test that closing a queue wakes its waiting threads and ends dequeue once it is empty
+void test_close() {
+    initQueue();
+    void *item;
+
+    // every kind of waiting thread wakes up with QUEUE_CLOSED
+    thrd_t threads[NUM_WAITERS];
+    for (long i = 0; i < NUM_WAITERS; ++i) {
+        atomic_store(&wakeup_data[i], 0);
+    }
+    thrd_create(&threads[0], dequeue_into_slot, (void *)0);
+    thrd_create(&threads[1], dequeue_into_slot, (void *)1);
+    thrd_create(&threads[2], dequeue_tag_into_slot, (void *)2);
+    short_sleep();
+    print_result("closeQueue - Threads are waiting", waiting() == NUM_WAITERS);
+    closeQueue();
+    for (int i = 0; i < NUM_WAITERS; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    print_result("closeQueue - Wakes every waiting thread", atomic_load(&wakeup_data[0]) == (long)QUEUE_CLOSED &&
+                 atomic_load(&wakeup_data[1]) == (long)QUEUE_CLOSED && atomic_load(&wakeup_data[2]) == (long)QUEUE_CLOSED &&
+                 waiting() == 0);
+
+    // what is in the queue still comes out, then every dequeue says closed instead of blocking
+    destroyQueue();
+    initQueue();
+    enqueue((void *)(long)1);
+    enqueue((void *)(long)2);
+    closeQueue();
+    struct timespec deadline = deadline_in_ms(1000);
+    void *out[2];
+    print_result("closeQueue - Items are still dequeued", (long)dequeue() == 1 && tryDequeue(&item) && (long)item == 2);
+    print_result("closeQueue - Dequeue of an empty closed queue returns", dequeue() == QUEUE_CLOSED &&
+                 !tryDequeue(&item) && item == QUEUE_CLOSED && !dequeueTimed(&item, &deadline) && item == QUEUE_CLOSED &&
+                 dequeueMany(out, 2) == 0 && dequeueTag(1) == QUEUE_CLOSED && ms_since(&deadline) < -500);
+
+    // dequeueAny reports the closed queue, unless another one has an item
+    queue_t *qs[2] = {queue_create(), queue_create()};
+    size_t which = 2;
+    queue_enqueue(qs[1], (void *)(long)3);
+    queue_close(qs[0]);
+    print_result("closeQueue - dequeueAny prefers items", (long)dequeueAny(qs, 2, &which) == 3 && which == 1);
+    print_result("closeQueue - dequeueAny reports the closed queue", dequeueAny(qs, 2, &which) == QUEUE_CLOSED && which == 0);
+    queue_destroy(qs[0]);
+    qs[0] = queue_create();
+    any_queues[0] = qs[0];
+    any_queues[1] = qs[1];
+    any_queues[2] = queue_create();
+    thrd_t thread;
+    thrd_create(&thread, dequeue_any_into_slot, NULL);
+    short_sleep();
+    queue_close(any_queues[2]);
+    thrd_join(thread, NULL);
+    print_result("closeQueue - Wakes a thread in dequeueAny", atomic_load(&wakeup_data[0]) == (long)QUEUE_CLOSED &&
+                 atomic_load(&wakeup_data[1]) == 2 && queue_waiting(qs[0]) == 0 && queue_waiting(qs[1]) == 0);
+    for (int i = 0; i < ANY_QUEUES; ++i) {
+        queue_destroy(any_queues[i]);
+    }
+    destroyQueue();
+
+    // destroying a queue wakes the threads still parked in it before it is torn down
+    initQueueBounded(1);
+    enqueue((void *)(long)1);
+    thrd_create(&threads[0], enqueue_blocking, (void *)(long)2);
+    short_sleep();
+    destroyQueue();
+    thrd_join(threads[0], NULL);
+    initQueue();
+    atomic_store(&wakeup_data[0], 0);
+    atomic_store(&wakeup_data[2], 0);
+    thrd_create(&threads[0], dequeue_into_slot, (void *)0);
+    thrd_create(&threads[2], dequeue_tag_into_slot, (void *)2);
+    short_sleep();
+    destroyQueue();
+    thrd_join(threads[0], NULL);
+    thrd_join(threads[2], NULL);
+    print_result("destroyQueue - Wakes the threads parked in the queue", atomic_load(&wakeup_data[0]) == (long)QUEUE_CLOSED &&
+                 atomic_load(&wakeup_data[2]) == (long)QUEUE_CLOSED);
+}
+
+#define STATS_ITEMS 200000
+
+static atomic_bool stats_done;
+
+int produce_for_stats(void *arg) {
+    (void)arg;
+    for (long i = 1; i <= STATS_ITEMS; ++i) {
+        enqueue((void *)i);
+    }
+    return 0;
+}
+
+int consume_for_stats(void *arg) {
+    (void)arg;
+    for (long i = 1; i <= STATS_ITEMS; ++i) {
+        dequeue();
+    }
+    return 0;
+}
+
+int poll_stats(void *arg) {
+    bool *consistent = (bool *)arg;
+    size_t last_visited = 0;
+    while (!atomic_load(&stats_done)) {
+        size_t v = visited();
+        // visited never goes down, and no counter ever shows a value that can't be right at some point
+        if (v < last_visited || v > STATS_ITEMS || size() > STATS_ITEMS || waiting() > 1) {
+            *consistent = false;
+        }
+        last_visited = v;
+    }
+    return 0;
+}
+
+// Function to test that the statistics can be polled while the queue is in use
+void test_stats_polling() {
+    initQueue();
+    atomic_store(&stats_done, false);
+
+    bool consistent = true;
+    thrd_t poller, producer, consumer;
+    thrd_create(&poller, poll_stats, &consistent);
+    thrd_create(&consumer, consume_for_stats, NULL);
+    thrd_create(&producer, produce_for_stats, NULL);
+    thrd_join(producer, NULL);
+    thrd_join(consumer, NULL);
+    atomic_store(&stats_done, true);
+    thrd_join(poller, NULL);
+
+    print_result("Stats - Consistent while polled concurrently", consistent);
+    print_result("Stats - Exact once the queue is idle", size() == 0 && waiting() == 0 && visited() == STATS_ITEMS);
+
+    destroyQueue();
+}
+
+// Function to test the latency histograms, the recorded values are only checked when built with -DQUEUE_INSTRUMENT
+void test_stats_snapshot() {
+    static queue_hist_t hist;
+    hist.count = 100;
+    hist.max_ns = 5000;
+    hist.buckets[3] = 50; // the value 3
+    hist.buckets[QUEUE_HIST_BUCKETS / 4] = 50;
+    print_result("Histogram - Percentiles", queue_hist_percentile(&hist, 50.0) == 3 &&
+                 queue_hist_percentile(&hist, 99.0) > 3 && queue_hist_percentile(&hist, 99.0) <= 5000);
+
+    initQueue();
+    static queue_stats_t before, after;
+    queue_stats_snapshot(&before);
+    for (long i = 1; i <= 100; ++i) {
+        enqueue((void *)i);
+    }
+    for (long i = 1; i <= 100; ++i) {
+        dequeue();
+    }
+    thrd_t thread;
+    thrd_create(&thread, dequeue_into_slot, (void *)0);
+    short_sleep();
+    enqueue((void *)(long)1);
+    thrd_join(thread, NULL);
+    queue_stats_snapshot(&after);
+#ifdef QUEUE_INSTRUMENT
+    print_result("Stats snapshot - Residency of every item", after.residency.count - before.residency.count == 101);
+    print_result("Stats snapshot - Parked and lock times", after.parked.count > before.parked.count &&
+                 after.parked.max_ns >= 50000000 && after.lock_wait.count > before.lock_wait.count &&
+                 after.lock_hold.count > before.lock_hold.count);
+#else
+    print_result("Stats snapshot - Empty when not instrumented", after.residency.count == 0 && after.parked.count == 0);
+#endif
+
+    // a thread parked in dequeueAny is timed like one parked in dequeue
+    for (int i = 0; i < ANY_QUEUES; ++i) {
+        any_queues[i] = queue_create();
+    }
+    thrd_create(&thread, dequeue_any_into_slot, NULL);
+    short_sleep();
+    queue_enqueue(any_queues[1], (void *)(long)1);
+    thrd_join(thread, NULL);
+    before = after;
+    queue_stats_snapshot(&after);
+#ifdef QUEUE_INSTRUMENT
+    print_result("Stats snapshot - Parked in dequeueAny", after.parked.count > before.parked.count &&
+                 after.parked.total_ns - before.parked.total_ns >= 50000000);
+#endif
+    for (int i = 0; i < ANY_QUEUES; ++i) {
+        queue_destroy(any_queues[i]);
+    }
+
+    destroyQueue();
+}
+
+int main() {
+    test_enqueue_many_order();
+    test_enqueue_many_wakes_waiters();
+    test_dequeue_many();
+    test_dequeue_many_blocks();
+    test_bounded();
+    test_dequeue_timed();
+    test_instances();
+    test_sharded();
+    test_spin_limit();
+    test_barging();
+    test_priority();
+    test_scheduled();
+    test_tagged();
+    test_tagged_high_bits();
+    test_dequeue_any();
+    test_close();
+    test_stats_polling();
+    test_stats_snapshot();
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include "queue.h"
+
+// Benchmark of the two handoff policies (see setPolicy) with more threads than cores, where every wakeup of a
+// parked consumer costs a context switch. Producers enqueue in small bursts with a pause in between so that the
+// consumers keep running dry and parking. Both policies run the same workload, one after the other, and for each
+// the benchmark prints ops/sec, context switches per item and the p50/p99 enqueue-to-dequeue latency.
+//
+// usage: handoff_bench [producers] [consumers] [items] [repetitions]
+
+#define DEFAULT_PRODUCERS 8
+#define DEFAULT_CONSUMERS 16
+#define DEFAULT_ITEMS 400000L
+#define DEFAULT_REPETITIONS 3
+#define BURST_SIZE 32
+#define BURST_PAUSE_NS 20000
+#define CONSUMER_WORK 200 // iterations of busy work per dequeued item
+
+static queue_t* q;
+static _Atomic uint64_t* enqueue_times; // every item is a pointer to its own slot, holding the time it was enqueued
+static uint64_t* latencies;
+static atomic_long next_latency;
+static long items_per_producer;
+static long items_per_consumer;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+long context_switches(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int producer(void *arg) {
+    long first = (long)arg * items_per_producer;
+    for (long i = 0; i < items_per_producer; ++i) {
+        atomic_store_explicit(&enqueue_times[first + i], now_ns(), memory_order_relaxed);
+        queue_enqueue(q, (void *)&enqueue_times[first + i]);
+        if ((i + 1) % BURST_SIZE == 0) {
+            thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = BURST_PAUSE_NS}, NULL);
+        }
+    }
+    return 0;
+}
+
+int consumer(void *arg) {
+    (void)arg;
+    volatile long work = 0;
+    for (long i = 0; i < items_per_consumer; ++i) {
+        _Atomic uint64_t *item = (_Atomic uint64_t *)queue_dequeue(q);
+        latencies[atomic_fetch_add_explicit(&next_latency, 1, memory_order_relaxed)] =
+            now_ns() - atomic_load_explicit(item, memory_order_relaxed);
+        for (int j = 0; j < CONSUMER_WORK; ++j) {
+            work = work + j;
+        }
+    }
+    return 0;
+}
+
+int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to run the workload once with the given policy and print its results
+void do_run(const char *name, queue_policy_t policy, int num_producers, int num_consumers, long total, int repetition) {
+    thrd_t producers[num_producers];
+    thrd_t consumers[num_consumers];
+
+    q = queue_create();
+    queue_set_policy(q, policy);
+    atomic_store(&next_latency, 0);
+    long switches = context_switches();
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_consumers; ++i) {
+        thrd_create(&consumers[i], consumer, NULL);
+    }
+    for (int i = 0; i < num_producers; ++i) {
+        thrd_create(&producers[i], producer, (void *)(long)i);
+    }
+    for (int i = 0; i < num_producers; ++i) {
+        thrd_join(producers[i], NULL);
+    }
+    for (int i = 0; i < num_consumers; ++i) {
+        thrd_join(consumers[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    switches = context_switches() - switches;
+    queue_destroy(q);
+
+    qsort(latencies, total, sizeof(*latencies), compare_latencies);
+    printf("policy=%-6s run=%d ops/sec=%.0f csw/item=%.3f p50_ns=%llu p99_ns=%llu\n", name, repetition, total / seconds,
+           (double)switches / total, (unsigned long long)latencies[total / 2], (unsigned long long)latencies[total * 99 / 100]);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int num_producers = argc > 1 ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+    int num_consumers = argc > 2 ? atoi(argv[2]) : DEFAULT_CONSUMERS;
+    long items = argc > 3 ? atol(argv[3]) : DEFAULT_ITEMS;
+    int repetitions = argc > 4 ? atoi(argv[4]) : DEFAULT_REPETITIONS;
+    // every producer/consumer pair needs at least one item, or there would be nothing to measure
+    if (num_producers < 1 || num_consumers < 1 || repetitions < 1 || items < (long)num_producers * num_consumers) {
+        fprintf(stderr, "usage: handoff_bench [producers] [consumers] [items] [repetitions]\n"
+                        "all of them at least 1, and items at least producers * consumers\n");
+        return 1;
+    }
+
+    // every producer and every consumer handles the same number of items
+    items_per_producer = items / ((long)num_producers * num_consumers) * num_consumers;
+    items_per_consumer = items_per_producer * num_producers / num_consumers;
+    long total = items_per_producer * num_producers;
+    enqueue_times = calloc(total, sizeof(*enqueue_times));
+    latencies = calloc(total, sizeof(*latencies));
+
+    printf("producers=%d consumers=%d items=%ld\n", num_producers, num_consumers, total);
+    // alternating the policies, so that a machine that gets busier during the benchmark doesn't favour one of them
+    for (int repetition = 1; repetition <= repetitions; ++repetition) {
+        do_run("fifo", QUEUE_STRICT_FIFO, num_producers, num_consumers, total, repetition);
+        do_run("barge", QUEUE_BARGING, num_producers, num_consumers, total, repetition);
+    }
+
+    free(enqueue_times);
+    free(latencies);
+    return 0;
+}
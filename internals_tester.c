@@ -0,0 +1,85 @@
+#include "queue.c"
+
+// Tests of queue.c internals. queue.c is included rather than linked, so its helpers can be driven one step at a time
+// to replay interleavings that threads only hit by chance
+
+// Helper function to print test results
+void print_result(const char *test_name, bool result) {
+    printf("%s: %s\n", test_name, result ? "PASSED" : "FAILED");
+}
+
+// Helper function to count the segments of a queue that are in its list and on its free stack
+void count_segments(Queue *pqueue, uint32_t *pin_list, uint32_t *pin_free) {
+    uint32_t idx;
+
+    *pin_list = 0;
+    for (idx = TAG_IDX(atomic_load(&pqueue->front)); idx != NIL_IDX; idx = TAG_IDX(atomic_load(&seg_at(&pqueue->pool, idx)->next))) {
+        ++*pin_list;
+    }
+    *pin_free = 0;
+    for (idx = TAG_IDX(atomic_load(&pqueue->pool.free_top)); idx != NIL_IDX; idx = atomic_load(&seg_at(&pqueue->pool, idx)->next_free)) {
+        ++*pin_free;
+    }
+}
+
+// Function to test a producer that stalls in advance_rear while the last segment it read is recycled and taken again
+void test_stale_rear() {
+    Queue *pqueue = queue_create();
+    void *item;
+
+    // the producer read rear while the first segment was the last one, then stalled
+    uint64_t stale_rear = atomic_load(&pqueue->rear);
+    Segment *pstale = seg_at(&pqueue->pool, TAG_IDX(stale_rear));
+    // meanwhile the segment fills up, a second one is linked after it, and once both are drained the first is recycled
+    for (long i = 1; i <= SEG_SLOTS + 1; ++i) {
+        queue_enqueue(pqueue, (void *)i);
+    }
+    bool drained = true;
+    for (long i = 1; i <= SEG_SLOTS + 1; ++i) {
+        drained = drained && queue_try_dequeue(pqueue, &item) && (long)item == i;
+    }
+    // another producer takes it from the free stack to link it as the next segment
+    uint32_t idx = take_segment(&pqueue->pool);
+    print_result("Stale rear - The last segment is taken again", drained && idx == TAG_IDX(stale_rear));
+
+    // the stalled producer goes on, it must not link a segment to the new incarnation
+    advance_rear(pqueue, stale_rear, pstale);
+    // the other producer lost the race to link its segment and recycles it
+    recycle_segment(&pqueue->pool, idx);
+    uint32_t in_list, in_free;
+    count_segments(pqueue, &in_list, &in_free);
+    print_result("Stale rear - No segment is leaked", in_list + in_free == pqueue->pool.nsegs);
+
+    queue_destroy(pqueue);
+}
+
+// Function to test a queue deep enough to need more blocks than the top level of its directory starts with
+void test_directory_growth() {
+    Queue *pqueue = queue_create();
+    long total = (long)(DIR_MIN_BLOCKS * DIR_BLOCK + 1) * SEG_SLOTS;
+    void *item;
+
+    for (long i = 1; i <= total; ++i) {
+        queue_enqueue(pqueue, (void *)i);
+    }
+    SegmentDir *pdir = atomic_load(&pqueue->pool.pdir);
+    print_result("Directory growth - The top level grew", pdir->nblocks > DIR_MIN_BLOCKS && pdir->pold != NULL);
+    uint32_t in_list, in_free;
+    count_segments(pqueue, &in_list, &in_free);
+    print_result("Directory growth - Every segment can be looked up", in_list + in_free == pqueue->pool.nsegs && pqueue->pool.nsegs > DIR_MIN_BLOCKS * DIR_BLOCK);
+
+    bool in_order = true;
+    for (long i = 1; i <= total; ++i) {
+        in_order = in_order && queue_try_dequeue(pqueue, &item) && (long)item == i;
+    }
+    print_result("Directory growth - Items come out in order", in_order && !queue_try_dequeue(pqueue, &item));
+
+    queue_destroy(pqueue);
+}
+
+int main() {
+    test_stale_rear();
+    test_directory_growth();
+
+    return 0;
+}
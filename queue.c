@@ -5,110 +5,908 @@
 #include <stdlib.h>
 #include <string.h>
 #include <threads.h>
+#include <stdatomic.h>
 #include "queue.h"
+// -------- DEFINES ----------
+
+// Items are stored in segments of SEG_SLOTS contiguous cells. The queue is a lock-free linked list of segments:
+// producers claim cells at the tail of the last segment and consumers claim cells at the head of the first one,
+// each with a CAS on a position inside the segment. Segments are referred to by a 32 bit index into a directory
+// and are never freed before destroyQueue, so a stale index can always be read safely, which is what makes the
+// list safe without hazard pointers. A segment that was emptied goes back to a free stack and is reused
+// with a new incarnation number, and every position and index that is CASed carries the incarnation it belongs to
+// (a "tagged" value), so a thread that read a segment before it was reused can't mistake it for the new one (ABA).
+#define NIL_IDX UINT32_MAX
+#define SEG_BITS 10
+#define SEG_SLOTS (1u << SEG_BITS) // number of item cells in a segment
+#define DIR_BLOCK_BITS 8
+#define DIR_BLOCK (1u << DIR_BLOCK_BITS) // number of segments in a block of the directory
+#define DIR_MIN_BLOCKS 4 // length of the top level of a new directory, it doubles whenever it fills up
+#define TH_SLOTS 64 // number of distinct thread slots, threads beyond that share slots
+#define CACHE_LINE 64
+#ifndef QUEUE_PACKED_LAYOUT
+#define LINE_ALIGNED _Alignas(CACHE_LINE) // starts a new cache line in Queue, so fields written by different threads don't false-share
+#else
+#define LINE_ALIGNED // old layout with all Queue fields packed together, only for comparing in cacheline_bench.c
+#endif
+#define SPIN_MIN 16 // the adaptive spin budget never drops below this (unless the limit is lower)
+#define SPIN_DEFAULT_LIMIT 2048 // default max number of polls before a consumer parks, see setSpinLimit
+#define SPIN_YIELD_EVERY 64 // spinning consumers yield this often, so a producer sharing their core gets to run
+#define MAX_LEVELS 64 // priority mode, one bit per level in the bitmap of non-empty levels
+#define LEVEL_BIT(level) (1ull << (level))
+#define TIMER_TICK_NS 1000000u // scheduled items are due with a resolution of 1 ms
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS) // slots of every level of the timing wheel
+#define WHEEL_LEVELS 11 // 11 levels of 6 bits cover every 64 bit tick, so the wheel never wraps around
+#define TAG_TABLE_MIN 16 // initial number of slots of the tag table, it doubles whenever it gets half full
+#define WAKE_BATCH 64 // wakeups a thread collects under queue.mutex before it has to signal the rest with the lock held
+
+// hint to the CPU that we are in a spin loop
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() ((void)0)
+#endif
+
+// Optional latency instrumentation, compiled in with -DQUEUE_INSTRUMENT and read with queue_stats_snapshot.
+// Without it these are the plain calls, and nothing is timed or stored. A thread keeps a single lock time, so the
+// _MUTEX variants are only for mutexes that are never taken while another one is held
+#ifdef QUEUE_INSTRUMENT
+#define LOCK_MUTEX(pmutex) instr_lock(pmutex)
+#define UNLOCK_MUTEX(pmutex) instr_unlock(pmutex)
+#define WAIT_MUTEX(pcond, pmutex) instr_wait(pcond, pmutex, NULL)
+#define TIMEDWAIT_MUTEX(pcond, pmutex, deadline) instr_wait(pcond, pmutex, deadline)
+#define STAMP_CELL(pseg, pos) atomic_store_explicit(&(pseg)->stamp[pos], now_ns(), memory_order_relaxed)
+#define RECORD_RESIDENCY(pseg, pos) record_latency(HIST_RESIDENCY, now_ns() - atomic_load_explicit(&(pseg)->stamp[pos], memory_order_relaxed))
+#else
+#define LOCK_MUTEX(pmutex) mtx_lock(pmutex)
+#define UNLOCK_MUTEX(pmutex) mtx_unlock(pmutex)
+#define WAIT_MUTEX(pcond, pmutex) cnd_wait(pcond, pmutex)
+#define TIMEDWAIT_MUTEX(pcond, pmutex, deadline) cnd_timedwait(pcond, pmutex, deadline)
+#define STAMP_CELL(pseg, pos) ((void)0)
+#define RECORD_RESIDENCY(pseg, pos) ((void)0)
+#endif
+#define LOCK_QUEUE(pqueue) LOCK_MUTEX(&(pqueue)->mutex)
+#define UNLOCK_QUEUE(pqueue) UNLOCK_MUTEX(&(pqueue)->mutex)
+#define WAIT_QUEUE(pcond, pqueue) WAIT_MUTEX(pcond, &(pqueue)->mutex)
+#define TIMEDWAIT_QUEUE(pcond, pqueue, deadline) TIMEDWAIT_MUTEX(pcond, &(pqueue)->mutex, deadline)
+
+#define TAGGED(idx, tag) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define TAG_IDX(tagged) ((uint32_t)(tagged))
+#define TAG_CNT(tagged) ((uint32_t)((tagged) >> 32))
+
 // -------- TYPEDEFS ----------
 
-// Define the structure that the queue is built of 
-typedef struct ItemNode { 
-    void* pdata;
-    struct ItemNode* pnext; // next item in queue
-} ItemNode;
+// Define the segment that the queue is built of. A segment is used front to back exactly once per incarnation:
+// cells [0, tail) were claimed by producers, cells [0, head) by consumers
+typedef struct Segment {
+    _Alignas(CACHE_LINE) _Atomic uint64_t head; // position of the next cell to dequeue, tagged with the incarnation
+    _Alignas(CACHE_LINE) _Atomic uint64_t tail; // position of the next cell to enqueue, tagged with the incarnation
+    _Alignas(CACHE_LINE) _Atomic uint64_t next; // tagged index of the next segment, NIL_IDX tagged with our incarnation while there is none
+    _Atomic uint32_t released; // number of cells whose items were read by their consumer, plus 1 once the segment left the list
+    _Atomic uint32_t next_free; // index of the next segment in the free stack
+    uint32_t inc; // incarnation, only changed while the segment is owned by the thread that took it from the free stack
+    _Atomic uint32_t full[SEG_SLOTS]; // incarnation in which the cell was filled, the cell holds an item once it equals inc
+    _Atomic(void*) data[SEG_SLOTS];
+#ifdef QUEUE_INSTRUMENT
+    _Atomic uint64_t stamp[SEG_SLOTS]; // when the item in the cell was enqueued, in ns
+#endif
+} Segment;
 
 // Define the thread node structure for keeping track of waiting threads
 typedef struct ThreadNode {
     cnd_t cond_var; // every thread has a cv + data associated with it
-    void* pdata; // 
+    void* pdata; //
+    bool delivered; // set by whoever hands pdata to this thread, protects against spurious wakeups
+    atomic_uint wakes_pending; // signals that were promised to this thread but not sent yet, the node can't be freed before they are
+    struct SelectWaiter* pselect; // set when the node stands in for a thread in dequeueAny, which waits on pselect instead of cond_var
+    size_t index; // dequeueAny, position of this node's queue in the array the thread passed
     struct ThreadNode* pnext;
 } ThreadNode;
 
-// Define the actual queue, built of Nodes
-typedef struct Queue {
-    ItemNode* pfront;
-    ItemNode* prear;
-    mtx_t mutex; // note that each queue requires only one mutex, but number of conds = number of threads associated with the queue
-    size_t size;
-    size_t visited;
-} Queue;
+// Define a thread waiting in dequeueAny. It has a ThreadNode in the th_queue of every queue it waits on, and the first
+// queue that hands one of them an item sets done, after which its nodes in the other queues are stale
+typedef struct SelectWaiter {
+    mtx_t mutex; // taken with the mutex of a queue held, never the other way round
+    cnd_t cond_var;
+    atomic_bool done; // written under mutex
+    void* pdata;
+    size_t which; // index of the queue pdata came from
+} SelectWaiter;
+
+// Define the wakeups a thread collected under queue.mutex, they are signaled only after the lock is released
+typedef struct WakeList {
+    ThreadNode* pths[WAKE_BATCH];
+    size_t count;
+} WakeList;
+
+// Define a scheduled item, it waits in the timing wheel until it is due and is then enqueued
+typedef struct TimerNode {
+    void* pdata;
+    uint64_t due; // in ticks since the epoch
+    struct TimerNode* pnext;
+} TimerNode;
+
+// Define a slot of the timing wheel, its nodes in the order they were put there
+typedef struct TimerSlot {
+    TimerNode* pfirst;
+    TimerNode* plast;
+} TimerSlot;
+
+// Define the hierarchical timing wheel holding the scheduled items of a queue. Level l has a slot for every value of
+// bits [6l, 6l + 6) of a tick. A node sits at the level of the highest digit in which its due tick differs from now,
+// in the slot of its own digit there, which is always ahead of now. When now reaches a slot of a higher level,
+// its nodes are put back in at the levels below, and when now reaches a slot of level 0, its nodes are due
+typedef struct TimerWheel {
+    TimerSlot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS]; // bit i is set while slots[level][i] holds nodes
+    uint64_t now; // in ticks since the epoch, every node due by now has been released
+    size_t count; // scheduled items in the wheel
+    TimerNode* pfree; // nodes of released items, kept for reuse
+} TimerWheel;
+
+// Define the segment directory. It has two levels: a top level of blocks, and blocks of DIR_BLOCK segments that are
+// allocated as the pool grows. Blocks never move, so seg_at needs no lock. When the top level fills up it is copied
+// into one twice as long, and the old one is kept until the pool is freed since readers may still be looking at it
+typedef struct SegmentDir {
+    uint32_t nblocks; // length of blocks
+    struct SegmentDir* pold; // the top level this one replaced
+    _Atomic(_Atomic(Segment*)*) blocks[]; // segment idx lives at blocks[idx / DIR_BLOCK][idx % DIR_BLOCK]
+} SegmentDir;
+
+// Define the pool that segments are taken from. Segments are allocated one at a time when the free stack is empty
+// and are then recycled, so that the steady state does no heap calls
+typedef struct SegmentPool {
+    _Atomic(SegmentDir*) pdir; // segment directory
+    uint32_t nsegs; // only touched under grow_mutex
+    _Atomic uint64_t free_top; // tagged index of the first free segment
+    mtx_t grow_mutex;
+} SegmentPool;
+
+// Define a stripe of the visited counter. Every dequeuing thread counts into the stripe of its thread slot,
+// so dequeues on different threads don't fight over a single cache line
+typedef struct VisitedStripe {
+    LINE_ALIGNED atomic_size_t count;
+} VisitedStripe;
 
 // Define queue of ThreadNodes, signifying waiting threads in FIFO order
 typedef struct ThreadQueue {
     ThreadNode* pfirst;
     ThreadNode* plast;
-    size_t waiting;
+    atomic_size_t waiting; // written under queue.mutex, read without it by the lock-free paths
 } ThreadQueue;
 
+// Define a tagged item in the list of its tag
+typedef struct TagNode {
+    void* pdata;
+    struct TagNode* pnext;
+} TagNode;
+
+// Define everything that belongs to a single tag: its items in FIFO order and the threads waiting for one of them.
+// Items only pile up while nobody waits for the tag, so at least one of the two lists is always empty
+typedef struct TagEntry {
+    uint32_t tag;
+    TagNode* pfirst;
+    TagNode* plast;
+    ThreadQueue waiters;
+} TagEntry;
+
+// Define the tags of a queue, an open addressing hash table of TagEntries that only grows (tags are never removed).
+// Entries are allocated one by one so a waiting thread can keep a pointer to its entry while the table grows
+typedef struct TagTable {
+    TagEntry** entries; // NULL for a free slot
+    size_t capacity; // a power of two
+    size_t used;
+    TagNode* pfree; // nodes of taken items, kept for reuse
+} TagTable;
+
+// Define the actual queue, built of Segments
+// The item storage is a lock-free singly linked list of segments, producers fill the cells of the last segment
+// and consumers empty the cells of the first one. A segment is only left once every one of its cells was claimed.
+// Fields are grouped by who writes them, and each group starts a cache line of its own, so that producers and consumers
+// working on opposite ends (and threads reading the statistics) don't keep taking cache lines away from each other
+typedef struct Queue {
+    // consumer side
+    LINE_ALIGNED _Atomic uint64_t front; // index of the first segment, tagged with its incarnation
+    atomic_size_t spin_budget; // current number of polls, adapts to how often spinning found an item
+    atomic_size_t spinning; // barging mode only, consumers in spin_for_item, enqueue leaves its items to them instead of waking a parked thread
+    atomic_size_t takes; // priority mode with aging only, how many times consumers picked a level
+    // producer side
+    LINE_ALIGNED _Atomic uint64_t rear; // index of the last segment, tagged with its incarnation
+    // statistics, size is written by both sides so it gets a line of its own
+    LINE_ALIGNED atomic_size_t size;
+    // visited is counted in stripes and only summed up by visited(), which keeps the largest sum so far here
+    LINE_ALIGNED atomic_size_t visited;
+    VisitedStripe visited_stripes[TH_SLOTS];
+    // bounded mode only, written by both sides
+    LINE_ALIGNED atomic_size_t reserved; // items in the queue plus items that are being enqueued
+    // priority mode only, written by both sides
+    LINE_ALIGNED _Atomic uint64_t nonempty_levels; // bit i is set while level i (probably) holds items
+    // parked threads, waiting counts are read by every operation but only written when a thread parks or is woken
+    LINE_ALIGNED mtx_t mutex; // only needed for parking threads, so it guards th_queue and prod_queue but not the item list
+    ThreadQueue th_queue; // consumers waiting for an item
+    ThreadQueue prod_queue; // producers waiting for a free slot in bounded mode
+    TimerWheel* pwheel; // scheduled items, created by the first enqueueAt
+    _Atomic uint64_t next_due; // when the wheel has to move next, in ns since the epoch, UINT64_MAX while nothing is scheduled
+    TagTable* ptags; // tagged items and the threads waiting for them, created by the first tagged call
+    atomic_size_t tagged; // tagged items in the queue, only written under mutex
+    atomic_size_t tag_waiting; // threads waiting for a tagged item, only written under mutex
+    atomic_size_t blocked; // threads that parked here and haven't released mutex for the last time yet, destroy waits for them
+    // read-mostly
+    LINE_ALIGNED size_t capacity; // max number of items in bounded mode, 0 means unbounded
+    atomic_size_t spin_limit; // max number of polls before parking, 0 means consumers park right away
+    _Atomic queue_policy_t policy; // whether running consumers may take items while threads are parked
+    atomic_bool closed; // set by queue_close, written under mutex
+    struct Queue* shards; // sharded (or priority) mode only, the sub-queues holding the items while this queue keeps the waiting threads
+    size_t nshards; // 0 when not sharded
+    bool prioritized; // priority mode, shards[i] holds the items of level i instead of a shard
+    atomic_size_t aging; // priority mode, every aging-th take goes to a lower level in turn, 0 means never
+    SegmentPool pool; // its free stack is written once per SEG_SLOTS items
+} Queue;
+
+#ifdef QUEUE_INSTRUMENT
+// Define the histograms of a single thread. Only the owning thread writes them, so recording needs no atomic RMW.
+// When the thread exits they are added to exited_stats and freed, so that its numbers still show up in snapshots
+enum { HIST_LOCK_WAIT, HIST_LOCK_HOLD, HIST_PARKED, HIST_RESIDENCY, HIST_KINDS };
+typedef struct ThreadStats {
+    _Atomic uint64_t count[HIST_KINDS];
+    _Atomic uint64_t total_ns[HIST_KINDS];
+    _Atomic uint64_t max_ns[HIST_KINDS];
+    _Atomic uint64_t buckets[HIST_KINDS][QUEUE_HIST_BUCKETS];
+    struct ThreadStats* pnext;
+} ThreadStats;
+#endif
+
 // -------- GLOBAL VARIABLES ----------
-static Queue queue;
-static ThreadQueue th_queue;
+static Queue queue; // the queue behind the functions of the assignment, other queues are created with queue_create
+static atomic_uint next_th_slot; // hands out thread slots (which shard a thread uses) round robin
+static _Thread_local unsigned th_slot = UINT32_MAX;
+static _Thread_local ThreadNode* pth_self = NULL; // the calling thread's ThreadNode, created on its first blocking dequeue
+static tss_t th_node_key; // only used so that pth_self is reclaimed when its thread exits
+static _Thread_local WakeList pending_wakes; // threads the calling thread handed something to and still has to signal
+static once_flag th_node_key_once = ONCE_FLAG_INIT;
+static char closed_marker; // only its address is used
+void* const QUEUE_CLOSED = &closed_marker;
+#ifdef QUEUE_INSTRUMENT
+static ThreadStats exited_stats; // the histograms of every thread that exited, always first in all_stats
+static ThreadStats* all_stats = &exited_stats; // every live thread's histograms, for queue_stats_snapshot
+static mtx_t stats_mutex; // guards all_stats and exited_stats
+static tss_t stats_key; // only used so that pstats_self is merged and freed when its thread exits
+static once_flag stats_once = ONCE_FLAG_INIT;
+static _Thread_local ThreadStats* pstats_self = NULL;
+static _Thread_local uint64_t lock_taken_at; // when the calling thread last got a queue mutex
+#endif
 
 // -------- HELPER FUNCTIONS SIGNATURES ----------
-ItemNode* create_item_node(void* pdata); // creates new ItemNode corresponding to pdata
-void append_item_node(Queue* pqueue, ItemNode* pitem); // appends ItemNode to Queue
-ItemNode* remove_first_item_node(Queue* pqueue); // removes and returns first ItemNode in queue (like pop())
-void iter_free_item_nodes(Queue* pqueue); // iteratively frees queue 
+Segment* seg_at(SegmentPool* ppool, uint32_t idx); // translates a segment index to a pointer
+void init_segment_pool(SegmentPool* ppool); // allocates the segment directory of an empty pool
+SegmentDir* new_segment_dir(SegmentDir* pold, uint32_t nblocks); // allocates a top level of nblocks blocks, holding those of pold
+unsigned thread_slot(void); // returns the slot of the calling thread, assigning one on first use
+uint32_t grow_segment_pool(SegmentPool* ppool); // allocates a new segment and returns its index
+uint32_t take_segment(SegmentPool* ppool); // takes a free segment (allocating one if there is none) and gives it a new incarnation
+void recycle_segment(SegmentPool* ppool, uint32_t idx); // pushes a segment that nobody uses anymore to the free stack
+SegmentDir* detach_segment_pool(SegmentPool* ppool, uint32_t* pnsegs); // empties the pool and returns its segment directory, to be freed by free_segments
+void free_segments(SegmentDir* pdir, uint32_t nsegs); // frees all segments of a detached directory at once, call without any queue lock
+void append_items(Queue* pqueue, void** items, size_t n); // appends n items to Queue, in order
+void advance_rear(Queue* pqueue, uint64_t rear, Segment* plast); // links a new segment after the full last segment and moves rear to it
+bool advance_front(Queue* pqueue, uint64_t front, Segment* pfirst); // unlinks the used up first segment, false if there is no segment after it
+void release_cells(Queue* pqueue, uint32_t idx, uint32_t n); // marks n cells of a segment as read, recycling the segment once it is done with
+size_t remove_first_items(Queue* pqueue, void** out, size_t max); // removes up to max first items in queue into out, returns how many
+size_t item_count(Queue* pqueue); // returns the number of items in the lock-free list (summed over the shards), tagged items not included
+size_t count_visited(Queue* pqueue); // sums up the visited stripes (and shards) of queue, never less than a previous call returned
+SegmentDir* detach_item_segments(Queue* pqueue, uint32_t* pnsegs); // empties the queue and returns its segments, to be freed by free_segments
+unsigned hist_bucket(uint64_t ns); // returns the histogram bucket of a value
+uint64_t hist_bucket_low(unsigned bucket); // returns the smallest value that falls in a histogram bucket
+#ifdef QUEUE_INSTRUMENT
+static uint64_t now_ns(void); // returns the current time in ns
+static void init_stats(void); // creates stats_mutex and stats_key, runs once
+static void free_thread_stats(void* pstats); // adds a thread's histograms to exited_stats and frees them, runs when the thread exits
+static void record_latency(int kind, uint64_t ns); // adds a value to the calling thread's histogram of that kind
+static void instr_lock(mtx_t* pmutex); // mtx_lock that records the wait for the lock
+static void instr_unlock(mtx_t* pmutex); // mtx_unlock that records how long the lock was held
+static int instr_wait(cnd_t* pcond, mtx_t* pmutex, const struct timespec* deadline); // cnd_(timed)wait that records how long the thread was parked
+#endif
+Queue* home_shard(Queue* pqueue); // returns the shard of the calling thread, or the queue itself when it is not sharded
+void push_items(Queue* pqueue, unsigned level, void** items, size_t n); // appends n items to the queue, in sharded mode to the calling thread's shard and in priority mode to level
+unsigned pick_level(Queue* pqueue, uint64_t levels); // returns the level to take from next out of a non-empty bitmap of levels
+uint64_t scan_levels(Queue* pqueue); // returns the bitmap of levels that hold items, from their sizes
+void mark_level_empty(Queue* pqueue, unsigned level); // clears the bit of a level that was found empty, unless it got items meanwhile
+size_t take_prioritized(Queue* pqueue, void** out, size_t max); // priority mode, removes up to max items into out, highest level first
+size_t take_items(Queue* pqueue, void** out, size_t max); // removes up to max items into out, in sharded mode stealing from other shards once its own is empty
+void init_queue(Queue* pqueue, size_t capacity, size_t nshards); // initializes an empty queue, capacity 0 means unbounded and nshards 0 means not sharded
+void init_priority_queue(Queue* pqueue, size_t nlevels); // initializes an empty queue in priority mode with nlevels levels (at least 1, at most MAX_LEVELS)
+void fini_queue(Queue* pqueue); // frees everything init_queue allocated
 
 ThreadNode* create_th_node(); // creates new ThreadNode (the pdata field is set in a different function)
+void free_th_node(void* pth); // destroys a ThreadNode, runs when the thread that owns it exits
+void create_th_node_key(void); // registers free_th_node as the thread exit destructor, runs once
+ThreadNode* get_th_node(void); // returns the calling thread's ThreadNode, ready to be appended to a ThreadQueue
 void append_th_node(ThreadQueue* pth_queue, ThreadNode* pth); // appends ThreadNode to ThreadQueue
 ThreadNode* remove_first_th_node(ThreadQueue* pth_queue); // removes and returns first ThreadNode in th_queue (like pop())
-void iter_free_thread_nodes(ThreadQueue* pth_queue); // iteratively frees th_queue
+void detach_th_nodes(ThreadQueue* pth_queue); // empties th_queue, the ThreadNodes belong to their threads and are not freed
+void remove_th_node(ThreadQueue* pth_queue, ThreadNode* pth); // removes pth from wherever it is in th_queue
+bool owed_to_waiters(Queue* pqueue); // true when the items in queue belong to parked threads, so a running consumer must not take them
+size_t hand_items_to_waiters(Queue* pqueue); // wakes waiting threads in FIFO order with items from queue, returns how many, call with queue.mutex held
+int hand_item_to_select(Queue* pqueue, ThreadNode* pth, bool closed); // hands the first item (QUEUE_CLOSED if closed) to pth's thread in dequeueAny unless another queue handed it something, 1 if it got an item, 0 if not (pth is removed either way), -1 if queue is empty, call with queue.mutex held
+void wake_closed(Queue* pqueue); // hands QUEUE_CLOSED to every thread still waiting for an item, call with queue.mutex held after handing out the items
+void signal_th_node(ThreadNode* pth); // wakes the thread waiting on pth (in dequeueAny, on its SelectWaiter)
+void wake_later(ThreadNode* pth); // signals pth once queue.mutex is released (or right away if too many are pending), call with queue.mutex held
+void wake_pending(void); // signals every thread wake_later collected, call after releasing queue.mutex (or before waiting on it)
+void notify_waiters(Queue* pqueue); // called after appending items, hands them out if threads are waiting
+void stop_spinning(Queue* pqueue, bool got_item); // barging mode, hands out what enqueues left to the spinners once the last one is done
+
+size_t try_reserve_slots(Queue* pqueue, size_t n); // bounded mode, reserves up to n free slots without blocking, returns how many
+size_t reserve_slots(Queue* pqueue, size_t n, const struct timespec* deadline); // bounded mode, blocks until at least one slot is reserved or deadline (NULL for none) passes
+void hand_slots_to_producers(Queue* pqueue); // wakes waiting producers in FIFO order with free slots, call with queue.mutex held
+void return_slots(Queue* pqueue, size_t n); // frees n slots of removed items, call with queue.mutex held
+void release_slots(Queue* pqueue, size_t n); // frees n slots of removed items, call without queue.mutex
+bool enqueue_reserved(Queue* pqueue, void* pdata, unsigned level, const struct timespec* deadline); // enqueues pdata (at level in priority mode) once it has a slot, false if deadline passed first
+uint64_t wall_ns(void); // returns the current TIME_UTC time in ns, the clock of deadlines
+uint64_t timespec_to_ns(const struct timespec* pts); // converts a TIME_UTC time to ns
+struct timespec ns_to_timespec(uint64_t ns); // converts ns back to a TIME_UTC time
+void wheel_insert(TimerWheel* pwheel, TimerNode* pnode); // puts a node that is due after now in its slot
+uint64_t wheel_next_event(TimerWheel* pwheel, unsigned* plevel); // returns the tick of the next slot the wheel reaches and its level, UINT64_MAX when empty
+TimerNode* wheel_advance(TimerWheel* pwheel, uint64_t tick); // moves now to tick, returns the list of nodes that came due in order
+void free_timer_wheel(TimerWheel* pwheel); // frees the wheel and all of its nodes, call without any queue lock
+void update_next_due(Queue* pqueue); // stores when the wheel has to move next, call with queue.mutex held
+void wake_timekeeper(Queue* pqueue); // lets the oldest waiting thread recompute when to wake up for scheduled items, call with queue.mutex held
+void release_due_items(Queue* pqueue); // enqueues the scheduled items that are due and hands them out, call with queue.mutex held
+void check_due_items(Queue* pqueue); // releases the scheduled items that are due, costs a single load while none are, call without queue.mutex
+size_t tag_hash(uint32_t tag); // spreads tags over the tag table
+TagEntry* find_tag(Queue* pqueue, uint32_t tag, bool create); // returns the entry of a tag (creating it if asked to, NULL otherwise), call with queue.mutex held
+void grow_tag_table(TagTable* ptags); // doubles the number of slots of the tag table
+void free_tag_table(TagTable* ptags); // frees the tag table with its entries and items, call without any queue lock
+void enqueue_tagged(Queue* pqueue, void* pdata, uint32_t tag); // hands pdata to the oldest thread waiting for tag, or appends it to the items of tag
+bool dequeue_tag(Queue* pqueue, uint32_t tag, void** ppdata, bool wait); // takes the first item of tag into *ppdata, waiting for one if asked to, false if there was none
+void enqueue_at(Queue* pqueue, void* pdata, uint64_t due_ns); // schedules pdata to be enqueued at due_ns (right away if that passed)
+const struct timespec* wake_time(Queue* pqueue, ThreadNode* pth, const struct timespec* deadline, struct timespec* pdue); // returns deadline, or *pdue set to when the next scheduled item is due if that is earlier and pth keeps time for them
+bool poll_for_item(Queue* pqueue, void** ppdata); // polls the queue up to spin_budget times, false if nothing came
+bool spin_for_item(Queue* pqueue, void** ppdata); // polls the queue for a while before parking (as a spinner in barging mode), false if nothing came
+bool dequeue_timed(Queue* pqueue, void** ppdata, const struct timespec* deadline); // dequeues into *ppdata, blocking until deadline (NULL for none), false if it passed first
+void* dequeue_any(Queue** pqueues, size_t n, size_t* pwhich); // dequeues from whichever of the n queues has an item first, its index goes to *pwhich
+
+// -------- SEGMENTPOOL HELPER FUNCTIONS IMPLEMENTATION ----------
+Segment* seg_at(SegmentPool* ppool, uint32_t idx)
+{
+    SegmentDir* pdir;
+    _Atomic(Segment*)* block;
+
+    // a thread that got hold of idx also sees the directory and the block it was stored in
+    pdir = atomic_load_explicit(&ppool->pdir, memory_order_acquire);
+    block = atomic_load_explicit(&pdir->blocks[idx >> DIR_BLOCK_BITS], memory_order_acquire);
+    return atomic_load_explicit(&block[idx & (DIR_BLOCK - 1)], memory_order_acquire);
+}
+
+void init_segment_pool(SegmentPool* ppool)
+{
+    // blocks are only allocated once segments go in them, so an idle pool costs no more than its top level
+    atomic_init(&ppool->pdir, new_segment_dir(NULL, DIR_MIN_BLOCKS));
+    ppool->nsegs = 0;
+    atomic_init(&ppool->free_top, TAGGED(NIL_IDX, 0));
+    mtx_init(&ppool->grow_mutex, mtx_plain);
+}
+
+SegmentDir* new_segment_dir(SegmentDir* pold, uint32_t nblocks)
+{
+    SegmentDir* pdir;
+    uint32_t i;
+
+    pdir = (SegmentDir*)malloc(sizeof(SegmentDir) + nblocks * sizeof(pdir->blocks[0])); // No error checking since we assume malloc never fails
+    pdir->nblocks = nblocks;
+    pdir->pold = pold;
+    for(i = 0; i < nblocks; i++)
+    {
+        atomic_init(&pdir->blocks[i], pold != NULL && i < pold->nblocks ? atomic_load_explicit(&pold->blocks[i], memory_order_relaxed) : NULL);
+    }
+    return pdir;
+}
+
+unsigned thread_slot(void)
+{
+    if(th_slot == UINT32_MAX)
+    {
+        th_slot = atomic_fetch_add_explicit(&next_th_slot, 1, memory_order_relaxed) % TH_SLOTS;
+    }
+    return th_slot;
+}
+
+uint32_t grow_segment_pool(SegmentPool* ppool)
+{
+    Segment* pseg;
+    SegmentDir* pdir;
+    _Atomic(Segment*)* block;
+    uint32_t idx;
+    uint32_t i;
+
+    pseg = (Segment*)aligned_alloc(_Alignof(Segment), sizeof(Segment)); // No error checking since we assume aligned_alloc never fails
+    atomic_init(&pseg->head, TAGGED(0, 0));
+    atomic_init(&pseg->tail, TAGGED(0, 0));
+    atomic_init(&pseg->next, TAGGED(NIL_IDX, 0));
+    atomic_init(&pseg->released, 0);
+    atomic_init(&pseg->next_free, NIL_IDX);
+    pseg->inc = 0; // the first incarnation is 1, so no cell counts as full yet
+    for(i = 0; i < SEG_SLOTS; i++)
+    {
+        atomic_init(&pseg->full[i], 0);
+        atomic_init(&pseg->data[i], NULL);
+    }
+    mtx_lock(&ppool->grow_mutex);
+    idx = ppool->nsegs;
+    ppool->nsegs++;
+    pdir = atomic_load_explicit(&ppool->pdir, memory_order_relaxed);
+    if(idx % DIR_BLOCK == 0) // the first segment of a block
+    {
+        if(idx / DIR_BLOCK == pdir->nblocks)
+        {
+            pdir = new_segment_dir(pdir, 2 * pdir->nblocks);
+            atomic_store_explicit(&ppool->pdir, pdir, memory_order_release);
+        }
+        block = (_Atomic(Segment*)*)calloc(DIR_BLOCK, sizeof(*block)); // No error checking since we assume calloc never fails
+        atomic_store_explicit(&pdir->blocks[idx / DIR_BLOCK], block, memory_order_release);
+    }
+    block = atomic_load_explicit(&pdir->blocks[idx / DIR_BLOCK], memory_order_relaxed);
+    // the segment must be visible in the directory before its index is
+    atomic_store_explicit(&block[idx % DIR_BLOCK], pseg, memory_order_release);
+    mtx_unlock(&ppool->grow_mutex);
+    return idx;
+}
+
+uint32_t take_segment(SegmentPool* ppool)
+{
+    uint64_t top;
+    uint32_t idx;
+    Segment* pseg;
+
+    top = atomic_load_explicit(&ppool->free_top, memory_order_acquire);
+    while(true)
+    {
+        idx = TAG_IDX(top);
+        if(idx == NIL_IDX) // free stack is empty
+        {
+            idx = grow_segment_pool(ppool);
+            break;
+        }
+        // if the segment was taken by someone else in the meantime, this read is stale but harmless since the CAS will fail
+        if(atomic_compare_exchange_weak_explicit(&ppool->free_top, &top,
+                                                 TAGGED(atomic_load_explicit(&seg_at(ppool, idx)->next_free, memory_order_acquire), TAG_CNT(top) + 1),
+                                                 memory_order_acq_rel, memory_order_acquire))
+        {
+            break;
+        }
+    }
+    // starting a new incarnation. Threads that still hold the old one see their positions no longer match and start over,
+    // and the cells need no clearing since a cell only counts as full when it holds the current incarnation
+    pseg = seg_at(ppool, idx);
+    pseg->inc++;
+    atomic_store_explicit(&pseg->released, 0, memory_order_relaxed);
+    atomic_store_explicit(&pseg->next, TAGGED(NIL_IDX, pseg->inc), memory_order_relaxed);
+    atomic_store_explicit(&pseg->head, TAGGED(0, pseg->inc), memory_order_relaxed);
+    atomic_store_explicit(&pseg->tail, TAGGED(0, pseg->inc), memory_order_relaxed);
+    return idx;
+}
+
+void recycle_segment(SegmentPool* ppool, uint32_t idx)
+{
+    uint64_t top;
+
+    top = atomic_load_explicit(&ppool->free_top, memory_order_acquire);
+    do
+    {
+        atomic_store_explicit(&seg_at(ppool, idx)->next_free, TAG_IDX(top), memory_order_release);
+    } while(!atomic_compare_exchange_weak_explicit(&ppool->free_top, &top, TAGGED(idx, TAG_CNT(top) + 1),
+                                                   memory_order_acq_rel, memory_order_acquire));
+}
+
+SegmentDir* detach_segment_pool(SegmentPool* ppool, uint32_t* pnsegs)
+{
+    SegmentDir* pdir;
+
+    // only the directory changes hands here, so this takes the same time however many segments the pool has
+    pdir = atomic_load(&ppool->pdir);
+    *pnsegs = ppool->nsegs;
+    atomic_store(&ppool->pdir, NULL);
+    ppool->nsegs = 0;
+    atomic_store(&ppool->free_top, TAGGED(NIL_IDX, 0));
+    mtx_destroy(&ppool->grow_mutex);
+    return pdir;
+}
+
+void free_segments(SegmentDir* pdir, uint32_t nsegs)
+{
+    SegmentDir* pold;
+    _Atomic(Segment*)* block;
+    uint32_t i;
+
+    // Freeing whole segments, every item cell lives in one of them
+    for(i = 0; i < nsegs; i++)
+    {
+        block = atomic_load_explicit(&pdir->blocks[i / DIR_BLOCK], memory_order_relaxed);
+        free(atomic_load_explicit(&block[i % DIR_BLOCK], memory_order_relaxed));
+    }
+    for(i = 0; i < pdir->nblocks; i++)
+    {
+        free(atomic_load_explicit(&pdir->blocks[i], memory_order_relaxed));
+    }
+    // the blocks were shared by every top level, those that were replaced only hold their own memory
+    while(pdir != NULL)
+    {
+        pold = pdir->pold;
+        free(pdir);
+        pdir = pold;
+    }
+}
 
 // -------- QUEUE HELPER FUNCTIONS IMPLEMENTATION ----------
-ItemNode* create_item_node(void* pdata)
+void append_items(Queue* pqueue, void** items, size_t n)
 {
-    ItemNode* pnew;
+    uint64_t rear;
+    uint64_t tail;
+    Segment* pseg;
+    uint32_t pos;
+    uint32_t count;
+    uint32_t i;
 
-    pnew = (ItemNode*)malloc(sizeof(ItemNode)); // No error checking since we assume malloc never fails
-    pnew->pdata = pdata;
-    pnew->pnext = NULL;
-    return pnew;
+    while(n > 0)
+    {
+        rear = atomic_load_explicit(&pqueue->rear, memory_order_acquire);
+        pseg = seg_at(&pqueue->pool, TAG_IDX(rear));
+        tail = atomic_load_explicit(&pseg->tail, memory_order_acquire);
+        if(TAG_CNT(tail) != TAG_CNT(rear)) // the segment was reused since we read rear
+        {
+            continue;
+        }
+        pos = TAG_IDX(tail);
+        if(pos == SEG_SLOTS) // the last segment is full
+        {
+            advance_rear(pqueue, rear, pseg);
+            continue;
+        }
+        // claiming as many cells of the last segment as we need, or as it has left
+        count = n < SEG_SLOTS - pos ? (uint32_t)n : SEG_SLOTS - pos;
+        if(!atomic_compare_exchange_weak_explicit(&pseg->tail, &tail, TAGGED(pos + count, TAG_CNT(tail)),
+                                                  memory_order_acq_rel, memory_order_acquire))
+        {
+            continue;
+        }
+        // counting the items before they are visible, so that size never drops below 0 when they are removed right away
+        atomic_fetch_add_explicit(&pqueue->size, count, memory_order_relaxed);
+        // filling the cells front to back, a consumer takes an item only once its cell is marked full
+        for(i = 0; i < count; i++)
+        {
+            atomic_store_explicit(&pseg->data[pos + i], items[i], memory_order_relaxed);
+            STAMP_CELL(pseg, pos + i);
+            atomic_store_explicit(&pseg->full[pos + i], TAG_CNT(tail), memory_order_release);
+        }
+        items += count;
+        n -= count;
+    }
 }
 
-void append_item_node(Queue* pqueue, ItemNode* pitem)
+void advance_rear(Queue* pqueue, uint64_t rear, Segment* plast)
 {
-    if(pqueue->pfront == NULL)
+    uint64_t next;
+    uint32_t idx;
+
+    next = atomic_load_explicit(&plast->next, memory_order_acquire);
+    if(TAG_IDX(next) == NIL_IDX)
     {
-        pqueue->pfront = pitem;
-        pqueue->prear = pitem;
+        // next is read from the segment as it is now, if it was recycled and taken again since we read rear it belongs to
+        // the new incarnation, which may not even be in the list yet. Linking our segment to it would lose ours
+        if(TAG_CNT(next) != TAG_CNT(rear))
+        {
+            return;
+        }
+        idx = take_segment(&pqueue->pool);
+        // the expected value is NIL tagged with the incarnation rear was read in, so this also fails if the segment is reused
+        // from here on
+        if(atomic_compare_exchange_strong_explicit(&plast->next, &next, TAGGED(idx, seg_at(&pqueue->pool, idx)->inc),
+                                                   memory_order_acq_rel, memory_order_acquire))
+        {
+            next = TAGGED(idx, seg_at(&pqueue->pool, idx)->inc);
+        }
+        else // someone else linked a segment first, ours was never linked anywhere
+        {
+            recycle_segment(&pqueue->pool, idx);
+        }
     }
-    else
+    // moving rear forward, whoever linked the segment may not have done so yet
+    if(TAG_IDX(next) != NIL_IDX)
     {
-        pqueue->prear->pnext = pitem;
-        pqueue->prear = pitem;
+        atomic_compare_exchange_strong_explicit(&pqueue->rear, &rear, next, memory_order_acq_rel, memory_order_acquire);
     }
-    pqueue->size++;
 }
 
-ItemNode* remove_first_item_node(Queue* pqueue)
+bool advance_front(Queue* pqueue, uint64_t front, Segment* pfirst)
 {
-    ItemNode* p_removed;
+    uint64_t next;
+    uint64_t rear;
 
-    p_removed = pqueue->pfront;
-    pqueue->pfront = pqueue->pfront->pnext;
-    pqueue->size--;
-    if(pqueue->pfront == NULL)  
+    next = atomic_load_explicit(&pfirst->next, memory_order_acquire);
+    if(TAG_IDX(next) == NIL_IDX)
+    {
+        // nothing after the first segment. That only means the queue is empty if it is still the first segment,
+        // otherwise it may have been reused and we read the next of its new incarnation
+        return atomic_load_explicit(&pqueue->front, memory_order_acquire) != front;
+    }
+    // rear must never point to a segment that left the list, so it is moved forward first if it is behind
+    rear = atomic_load_explicit(&pqueue->rear, memory_order_acquire);
+    if(rear == front)
+    {
+        atomic_compare_exchange_strong_explicit(&pqueue->rear, &rear, next, memory_order_acq_rel, memory_order_acquire);
+    }
+    if(atomic_compare_exchange_strong_explicit(&pqueue->front, &front, next, memory_order_acq_rel, memory_order_acquire))
     {
-        pqueue->prear = NULL;
+        release_cells(pqueue, TAG_IDX(front), 1);
     }
+    return true;
+}
 
-    pqueue->visited++;
-    return p_removed;
+void release_cells(Queue* pqueue, uint32_t idx, uint32_t n)
+{
+    // the segment can be reused once all of its items were read and it is no longer in the list, whoever is last recycles it
+    if(atomic_fetch_add_explicit(&seg_at(&pqueue->pool, idx)->released, n, memory_order_acq_rel) + n == SEG_SLOTS + 1)
+    {
+        recycle_segment(&pqueue->pool, idx);
+    }
 }
 
-void iter_free_item_nodes(Queue* pqueue)
+size_t remove_first_items(Queue* pqueue, void** out, size_t max)
 {
-    ItemNode* pcurr;
-    ItemNode* pto_free; // this is the ItemNode to be freed
+    uint64_t front;
+    uint64_t head;
+    Segment* pseg;
+    uint32_t pos;
+    uint32_t count;
+    uint32_t i;
+    size_t n = 0;
 
-    // Iteratively freeing ItemNodes in queue
-    pcurr = queue.pfront;
-    while(pcurr != NULL)
+    while(n < max)
     {
-        pto_free = pcurr;
-        pcurr = pcurr->pnext;
-        free(pto_free);
+        front = atomic_load_explicit(&pqueue->front, memory_order_acquire);
+        pseg = seg_at(&pqueue->pool, TAG_IDX(front));
+        head = atomic_load_explicit(&pseg->head, memory_order_acquire);
+        if(TAG_CNT(head) != TAG_CNT(front)) // the segment was reused since we read front
+        {
+            continue;
+        }
+        pos = TAG_IDX(head);
+        if(pos == SEG_SLOTS) // every item of the first segment was taken, moving on to the next one
+        {
+            if(!advance_front(pqueue, front, pseg))
+            {
+                break;
+            }
+            continue;
+        }
+        // counting the filled cells from head on, up to what we still need
+        count = 0;
+        while(n + count < max && pos + count < SEG_SLOTS &&
+              atomic_load_explicit(&pseg->full[pos + count], memory_order_acquire) == TAG_CNT(head))
+        {
+            count++;
+        }
+        if(count == 0)
+        {
+            // no filled cell at head. That only means the queue is empty if head didn't move,
+            // otherwise the segment may have been reused and we read a cell of its new incarnation
+            if(atomic_load_explicit(&pseg->head, memory_order_acquire) == head)
+            {
+                break;
+            }
+            continue;
+        }
+        if(!atomic_compare_exchange_weak_explicit(&pseg->head, &head, TAGGED(pos + count, TAG_CNT(head)),
+                                                  memory_order_acq_rel, memory_order_acquire))
+        {
+            continue;
+        }
+        // the cells are ours now, and the segment can't be reused before we release them
+        for(i = 0; i < count; i++)
+        {
+            out[n + i] = atomic_load_explicit(&pseg->data[pos + i], memory_order_relaxed);
+            RECORD_RESIDENCY(pseg, pos + i);
+        }
+        release_cells(pqueue, TAG_IDX(front), count);
+        n += count;
+    }
+    if(n > 0)
+    {
+        atomic_fetch_sub_explicit(&pqueue->size, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pqueue->visited_stripes[thread_slot()].count, n, memory_order_relaxed);
+    }
+    return n;
+}
+
+size_t item_count(Queue* pqueue)
+{
+    size_t total;
+    size_t i;
+
+    total = atomic_load_explicit(&pqueue->size, memory_order_relaxed);
+    for(i = 0; i < pqueue->nshards; i++)
+    {
+        total += atomic_load_explicit(&pqueue->shards[i].size, memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t count_visited(Queue* pqueue)
+{
+    size_t total = 0;
+    size_t seen;
+    size_t i;
+
+    // every stripe only grows, so the sum lies between the true count when we started and when we finished.
+    // keeping the largest sum so far makes visited() monotonic for all callers without ever going above the true count,
+    // and once no dequeue is running the sum is exact
+    for(i = 0; i < TH_SLOTS; i++)
+    {
+        total += atomic_load_explicit(&pqueue->visited_stripes[i].count, memory_order_relaxed);
+    }
+    for(i = 0; i < pqueue->nshards; i++)
+    {
+        total += count_visited(&pqueue->shards[i]);
+    }
+    seen = atomic_load_explicit(&pqueue->visited, memory_order_relaxed);
+    while(seen < total && !atomic_compare_exchange_weak_explicit(&pqueue->visited, &seen, total, memory_order_relaxed, memory_order_relaxed))
+    {
+        // the failed CAS reloaded seen, we try again unless someone else already stored a larger sum
+    }
+    return seen > total ? seen : total;
+}
+
+SegmentDir* detach_item_segments(Queue* pqueue, uint32_t* pnsegs)
+{
+    // items are never freed one by one, they all go away with the segments of the pool
+    atomic_store(&pqueue->front, TAGGED(NIL_IDX, 0));
+    atomic_store(&pqueue->rear, TAGGED(NIL_IDX, 0));
+    return detach_segment_pool(&pqueue->pool, pnsegs);
+}
+
+// -------- SHARDED MODE HELPER FUNCTIONS IMPLEMENTATION ----------
+// In sharded mode items live in nshards sub-queues, each with its own lock-free list and segment pool, so producers on
+// different shards never touch the same cache lines. Threads are spread over the shards by their thread slot.
+// A thread always pushes to the same shard, so items of a single producer still come out in the order it enqueued them
+
+Queue* home_shard(Queue* pqueue)
+{
+    if(pqueue->nshards == 0)
+    {
+        return pqueue;
+    }
+    return &pqueue->shards[thread_slot() % pqueue->nshards];
+}
+
+void push_items(Queue* pqueue, unsigned level, void** items, size_t n)
+{
+    if(pqueue->prioritized)
+    {
+        level = level < pqueue->nshards ? level : (unsigned)pqueue->nshards - 1;
+        append_items(&pqueue->shards[level], items, n);
+        // set after the items are in, so whoever sees the bit also sees them
+        atomic_fetch_or(&pqueue->nonempty_levels, LEVEL_BIT(level));
+        return;
+    }
+    append_items(home_shard(pqueue), items, n);
+}
+
+size_t take_items(Queue* pqueue, void** out, size_t max)
+{
+    size_t home;
+    size_t i;
+    size_t n = 0;
+
+    if(pqueue->nshards == 0)
+    {
+        return remove_first_items(pqueue, out, max);
+    }
+    if(pqueue->prioritized)
+    {
+        return take_prioritized(pqueue, out, max);
+    }
+    // own shard first, then stealing from the others in order
+    home = (size_t)(home_shard(pqueue) - pqueue->shards);
+    for(i = 0; i < pqueue->nshards && n < max; i++)
+    {
+        n += remove_first_items(&pqueue->shards[(home + i) % pqueue->nshards], out + n, max - n);
+    }
+    return n;
+}
+
+// -------- PRIORITY MODE HELPER FUNCTIONS IMPLEMENTATION ----------
+// In priority mode every level has a sub-queue of its own (in shards), and a bitmap tells which levels hold items, so the
+// highest non-empty level is found with a single count-leading-zeros. Items of a level come out in FIFO order.
+// The bitmap is only a hint: a consumer that finds a level empty clears its bit, and a producer may add an item right
+// then, so before reporting the queue empty the levels are checked by their sizes, which are exact
+
+unsigned pick_level(Queue* pqueue, uint64_t levels)
+{
+    size_t aging;
+    size_t takes;
+    size_t turn;
+    uint64_t below;
+
+    aging = atomic_load_explicit(&pqueue->aging, memory_order_relaxed);
+    if(aging == 0)
+    {
+        return 63 - (unsigned)__builtin_clzll(levels);
+    }
+    // counted per queue, so the turns go around however the takes are spread over threads
+    takes = atomic_fetch_add_explicit(&pqueue->takes, 1, memory_order_relaxed) + 1;
+    if(takes % aging == 0)
+    {
+        // every aging-th take belongs to the highest non-empty level at or below the one whose turn it is, the turn goes
+        // around all levels, so even the lowest level gets an item every aging * nlevels takes
+        turn = (takes / aging) % pqueue->nshards;
+        below = levels & ((LEVEL_BIT(turn) << 1) - 1);
+        if(below != 0)
+        {
+            return 63 - (unsigned)__builtin_clzll(below);
+        }
+    }
+    return 63 - (unsigned)__builtin_clzll(levels);
+}
+
+uint64_t scan_levels(Queue* pqueue)
+{
+    uint64_t levels = 0;
+    size_t i;
+
+    for(i = 0; i < pqueue->nshards; i++)
+    {
+        if(atomic_load_explicit(&pqueue->shards[i].size, memory_order_acquire) > 0)
+        {
+            levels |= LEVEL_BIT(i);
+        }
+    }
+    return levels;
+}
+
+void mark_level_empty(Queue* pqueue, unsigned level)
+{
+    atomic_fetch_and(&pqueue->nonempty_levels, ~LEVEL_BIT(level));
+    // a producer that set the bit again before we cleared it has its items counted in size by now
+    if(atomic_load_explicit(&pqueue->shards[level].size, memory_order_acquire) > 0)
+    {
+        atomic_fetch_or(&pqueue->nonempty_levels, LEVEL_BIT(level));
+    }
+}
+
+size_t take_prioritized(Queue* pqueue, void** out, size_t max)
+{
+    uint64_t levels;
+    unsigned level;
+    size_t got;
+    size_t n = 0;
+    bool scanned = false;
+
+    levels = atomic_load_explicit(&pqueue->nonempty_levels, memory_order_acquire);
+    while(n < max)
+    {
+        if(levels == 0)
+        {
+            // nothing left according to the bitmap, checking the sizes once in case a bit was cleared a moment ago
+            if(n > 0 || scanned || (levels = scan_levels(pqueue)) == 0)
+            {
+                break;
+            }
+            scanned = true;
+        }
+        level = pick_level(pqueue, levels);
+        got = remove_first_items(&pqueue->shards[level], out + n, max - n);
+        if(got < max - n) // the level ran dry (or its next item isn't written yet), the lower levels are next
+        {
+            levels &= ~LEVEL_BIT(level);
+            if(got == 0)
+            {
+                mark_level_empty(pqueue, level);
+            }
+        }
+        n += got;
     }
-    pqueue->pfront = NULL;
-    pqueue->prear = NULL;
+    return n;
 }
 
 // -------- THREADQUEUE HELPER FUNCTIONS IMPLEMENTATION ----------
@@ -118,14 +916,51 @@ ThreadNode* create_th_node()
 
     pnew = (ThreadNode*)malloc(sizeof(ThreadNode)); // No error checking since we assume malloc never fails
     // pdata of the newly created thread stays NULL for now, will be set when the thread is woken up
+    pnew->pdata = NULL;
+    pnew->delivered = false;
+    atomic_init(&pnew->wakes_pending, 0);
+    pnew->pselect = NULL;
+    pnew->index = 0;
+    pnew->pnext = NULL;
     // setting conditional variable for the thread corresponding with this ThreadNode
     cnd_init(&(pnew->cond_var));
     return pnew;
 }
 
+void free_th_node(void* pth)
+{
+    // the thread may have gotten its last item before whoever handed it over got to signal it
+    while(atomic_load_explicit(&((ThreadNode*)pth)->wakes_pending, memory_order_acquire) > 0)
+    {
+        thrd_yield();
+    }
+    cnd_destroy(&(((ThreadNode*)pth)->cond_var));
+    free(pth);
+}
+
+void create_th_node_key(void)
+{
+    tss_create(&th_node_key, free_th_node);
+}
+
+ThreadNode* get_th_node(void)
+{
+    // every thread creates its ThreadNode (and its cv) once and reuses it for all of its dequeues
+    if(pth_self == NULL)
+    {
+        call_once(&th_node_key_once, create_th_node_key);
+        pth_self = create_th_node();
+        tss_set(th_node_key, pth_self);
+    }
+    pth_self->pdata = NULL;
+    pth_self->delivered = false;
+    pth_self->pnext = NULL;
+    return pth_self;
+}
+
 void append_th_node(ThreadQueue* pth_queue, ThreadNode* pth)
 {
-    if(pth_queue->pfirst == NULL) 
+    if(pth_queue->pfirst == NULL)
     {
         pth_queue->pfirst = pth;
         pth_queue->plast = pth;
@@ -135,7 +970,7 @@ void append_th_node(ThreadQueue* pth_queue, ThreadNode* pth)
         pth_queue->plast->pnext = pth;
         pth_queue->plast = pth;
     }
-    pth_queue->waiting++;
+    atomic_fetch_add(&pth_queue->waiting, 1);
 }
 
 ThreadNode* remove_first_th_node(ThreadQueue* pth_queue)
@@ -144,7 +979,7 @@ ThreadNode* remove_first_th_node(ThreadQueue* pth_queue)
 
     p_removed_th = pth_queue->pfirst;
     pth_queue->pfirst = p_removed_th->pnext;
-    pth_queue->waiting--;
+    atomic_fetch_sub(&pth_queue->waiting, 1);
     if(pth_queue->pfirst == NULL) // if num of waiting threads is now 0 we need to set plast to NULL
     {
         pth_queue->plast = NULL;
@@ -154,151 +989,1806 @@ ThreadNode* remove_first_th_node(ThreadQueue* pth_queue)
 }
 
 
-void iter_free_th_nodes(ThreadQueue* pth_queue)
+void remove_th_node(ThreadQueue* pth_queue, ThreadNode* pth)
 {
+    ThreadNode* pprev = NULL;
     ThreadNode* pcurr;
-    ThreadNode* pto_free; // this is the ItemNode to be freed
 
-    // Iteratively freeing ItemNodes in queue
-    pcurr = th_queue.pfirst;
-    while(pcurr != NULL)
+    pcurr = pth_queue->pfirst;
+    while(pcurr != NULL && pcurr != pth)
     {
-        pto_free = pcurr;
+        pprev = pcurr;
         pcurr = pcurr->pnext;
-        cnd_destroy(&(pto_free->cond_var));
-        free(pto_free);
     }
+    if(pcurr == NULL) // not in th_queue (anymore)
+    {
+        return;
+    }
+    if(pprev == NULL)
+    {
+        remove_first_th_node(pth_queue);
+        return;
+    }
+    pprev->pnext = pth->pnext;
+    if(pth_queue->plast == pth)
+    {
+        pth_queue->plast = pprev;
+    }
+    pth->pnext = NULL;
+    atomic_fetch_sub(&pth_queue->waiting, 1);
+}
+
+void detach_th_nodes(ThreadQueue* pth_queue)
+{
+    // ThreadNodes are owned by their threads and are freed when their thread exits,
+    // so there is nothing to free here (get_th_node resets pnext before a node is appended again)
     pth_queue->pfirst = NULL;
     pth_queue->plast = NULL;
 }
 
-// -------- LIBRARY FUNCTIONS IMPLEMENTATION ----------
-
-void initQueue(void)
+size_t hand_items_to_waiters(Queue* pqueue)
 {
-    // Initializing queue
-    queue.pfront = NULL;
-    queue.prear = NULL;
-    mtx_init(&queue.mutex, mtx_plain);
-    queue.size = 0;
-    queue.visited = 0;
-    // Initializing th_queue
-    th_queue.pfirst = NULL;
-    th_queue.plast = NULL;
-    th_queue.waiting = 0;
+    ThreadNode* pth;
+    void* pdata;
+    size_t handed = 0;
+
+    int got;
+
+    // every item that is in the queue while threads are waiting belongs to the oldest waiting thread
+    while((pth = pqueue->th_queue.pfirst) != NULL)
+    {
+        if(pth->pselect != NULL)
+        {
+            got = hand_item_to_select(pqueue, pth, false);
+            if(got < 0)
+            {
+                break;
+            }
+            handed += got;
+            continue;
+        }
+        if(take_items(pqueue, &pdata, 1) != 1)
+        {
+            break;
+        }
+        remove_first_th_node(&pqueue->th_queue);
+        pth->pdata = pdata;
+        pth->delivered = true;
+        wake_later(pth);
+        handed++;
+    }
+    if(handed > 0)
+    {
+        wake_timekeeper(pqueue); // whoever is first now keeps time for the scheduled items
+    }
+    return handed;
 }
 
-void destroyQueue(void)
+// A thread in dequeueAny has a node in several queues, and each of them may want to hand it an item at the same time.
+// Whether it still needs one is checked and the item is taken under the mutex of its SelectWaiter, so exactly one
+// queue delivers, and an item is never taken for a thread that then turns out not to need it
+int hand_item_to_select(Queue* pqueue, ThreadNode* pth, bool closed)
 {
-    mtx_lock(&queue.mutex);
-    iter_free_item_nodes(&queue); // iteratively freeing ItemNodes in queue
-    iter_free_th_nodes(&th_queue); // iteratively freeing ThreadNodes in th_queue
-    queue.size = 0;
-    queue.visited = 0;
-    th_queue.waiting = 0;
+    SelectWaiter* pselect = pth->pselect;
+    void* pdata = QUEUE_CLOSED;
+    bool stale;
 
-    mtx_unlock(&queue.mutex);
-    mtx_destroy(&queue.mutex);
+    // a plain lock, the queue's lock is held and its hold time is being measured
+    mtx_lock(&pselect->mutex);
+    stale = atomic_load_explicit(&pselect->done, memory_order_relaxed);
+    if(!stale)
+    {
+        if(!closed && take_items(pqueue, &pdata, 1) != 1)
+        {
+            mtx_unlock(&pselect->mutex);
+            return -1;
+        }
+        pselect->pdata = pdata;
+        pselect->which = pth->index;
+        atomic_store_explicit(&pselect->done, true, memory_order_relaxed);
+    }
+    mtx_unlock(&pselect->mutex);
+    // a stale node is dropped, so it doesn't hold up the threads behind it
+    remove_first_th_node(&pqueue->th_queue);
+    pth->delivered = true; // tells dequeue_any the node is out of th_queue
+    if(stale)
+    {
+        return 0;
+    }
+    wake_later(pth);
+    return closed ? 0 : 1;
 }
 
-void enqueue(void* pdata)
+// Closing a queue wakes all of its waiting threads in a single pass under the lock, instead of a sentinel item (and a lock
+// round trip) for each of them. It is only called once the items were handed out, so none of these threads has one coming
+void wake_closed(Queue* pqueue)
 {
     ThreadNode* pth;
-    ItemNode* pitem;
+    TagEntry* pentry;
+    size_t i;
+
+    while((pth = pqueue->th_queue.pfirst) != NULL)
+    {
+        if(pth->pselect != NULL)
+        {
+            hand_item_to_select(pqueue, pth, true);
+            continue;
+        }
+        remove_first_th_node(&pqueue->th_queue);
+        pth->pdata = QUEUE_CLOSED;
+        pth->delivered = true;
+        wake_later(pth);
+    }
+    if(pqueue->ptags == NULL)
+    {
+        return;
+    }
+    // a tag that threads wait for holds no items
+    for(i = 0; i < pqueue->ptags->capacity; i++)
+    {
+        pentry = pqueue->ptags->entries[i];
+        while(pentry != NULL && pentry->waiters.pfirst != NULL)
+        {
+            pth = remove_first_th_node(&pentry->waiters);
+            atomic_fetch_sub(&pqueue->tag_waiting, 1);
+            pth->pdata = QUEUE_CLOSED;
+            pth->delivered = true;
+            wake_later(pth);
+        }
+    }
+}
 
-    mtx_lock(&queue.mutex);
-    if(th_queue.pfirst != NULL) // threads are waiting  
+void signal_th_node(ThreadNode* pth)
+{
+    if(pth->pselect == NULL)
     {
-        // wake up the right thread
-        pth = remove_first_th_node(&th_queue);
-        pth -> pdata = pdata;
         cnd_signal(&(pth->cond_var));
+        return;
     }
-    else // th_queue is empty
+    // under its mutex, so that a thread in dequeueAny that is about to wait for the next scheduled item doesn't miss it
+    mtx_lock(&pth->pselect->mutex);
+    cnd_signal(&pth->pselect->cond_var);
+    mtx_unlock(&pth->pselect->mutex);
+}
+
+// A burst of items for many parked threads means a futex wake for every one of them. They are only collected while
+// queue.mutex is held and signaled after it is released, so the critical section doesn't include the syscalls and
+// the woken threads don't run straight into a lock that is still held. Every thread has a cv of its own, so the
+// signals can't be merged into a broadcast
+void wake_later(ThreadNode* pth)
+{
+    if(pending_wakes.count == WAKE_BATCH)
     {
-        // insert item into queue without waking a thread up 
-        pitem = create_item_node(pdata);
-        append_item_node(&queue, pitem);
+        signal_th_node(pth);
+        return;
     }
-    mtx_unlock(&queue.mutex);
+    atomic_fetch_add_explicit(&pth->wakes_pending, 1, memory_order_relaxed);
+    pending_wakes.pths[pending_wakes.count++] = pth;
 }
 
-void* dequeue(void)
+void wake_pending(void)
 {
-    ItemNode* pitem;
+    size_t i;
     ThreadNode* pth;
-    void* pret_data = NULL;
 
-    mtx_lock(&queue.mutex);
-
-    if(queue.pfront == NULL) // no item to dequeue
-    {
-        // create thread node to be associated with this dequeue action, and append it to th_queue
-        pth = create_th_node();
-        append_th_node(&th_queue, pth);
-        // put thread to sleep so it can be signaled by enqueue when another item is inserted 
-        cnd_wait(&(pth->cond_var), &queue.mutex);
-        // pth is popped from th_queue by enqueue
-        // enqueue transfers the item's data to pth, so it can be returned before even being inserted into queue
-        // now transferring data associated with dequeued item to be returned
-        pret_data = pth->pdata;
-        // updating visited
-        queue.visited++;
-        // destroying cv of removed thread
-        cnd_destroy(&(pth->cond_var));
-        // freeing removed thread
-        free(pth);
-    }
-
-    else // there is an item in the queue to dequeue
-    {
-        // remove front of queue
-        pitem = remove_first_item_node(&queue);
-        // transfer the data from popped front to pret_data
-        pret_data = pitem->pdata;
-        // free popped item
-        free(pitem);
-    }
-    mtx_unlock(&queue.mutex);
-    return pret_data;
+    for(i = 0; i < pending_wakes.count; i++)
+    {
+        pth = pending_wakes.pths[i];
+        // the thread may already have seen delivered and moved on (its cv is still valid until wakes_pending drops),
+        // then this is just a spurious wakeup of whatever it waits for next
+        signal_th_node(pth);
+        atomic_fetch_sub_explicit(&pth->wakes_pending, 1, memory_order_release);
+    }
+    pending_wakes.count = 0;
 }
 
-bool tryDequeue(void** returned_ptr)
+bool owed_to_waiters(Queue* pqueue)
+{
+    // in barging mode items go to whoever comes first, parked threads only get what running consumers leave
+    return atomic_load_explicit(&pqueue->th_queue.waiting, memory_order_acquire) > 0 &&
+           atomic_load_explicit(&pqueue->policy, memory_order_relaxed) == QUEUE_STRICT_FIFO;
+}
+
+void notify_waiters(Queue* pqueue)
+{
+    // a consumer that registered as waiting before seeing our items will sleep until someone hands them over,
+    // the fence pairs with the one in dequeue so that at least one of us sees the other
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&pqueue->th_queue.waiting, memory_order_relaxed) > 0 && // threads are waiting
+       (atomic_load_explicit(&pqueue->policy, memory_order_relaxed) == QUEUE_STRICT_FIFO ||
+        atomic_load_explicit(&pqueue->spinning, memory_order_relaxed) == 0)) // and in barging mode, no running consumer will take the items
+    {
+        // wake up the right threads
+        LOCK_QUEUE(pqueue);
+        return_slots(pqueue, hand_items_to_waiters(pqueue));
+        UNLOCK_QUEUE(pqueue);
+        wake_pending();
+    }
+}
+
+void stop_spinning(Queue* pqueue, bool got_item)
+{
+    atomic_fetch_sub(&pqueue->spinning, 1);
+    // a spinner that found nothing parks next and hands out whatever is there itself. One that got an item may leave
+    // others behind that enqueues didn't hand out because we were spinning, the fence pairs with the one in notify_waiters
+    // so that if an enqueue saw us still spinning, we see its items here
+    atomic_thread_fence(memory_order_seq_cst);
+    if(got_item && atomic_load_explicit(&pqueue->spinning, memory_order_relaxed) == 0 &&
+       atomic_load_explicit(&pqueue->th_queue.waiting, memory_order_relaxed) > 0 && item_count(pqueue) > 0)
+    {
+        LOCK_QUEUE(pqueue);
+        return_slots(pqueue, hand_items_to_waiters(pqueue));
+        UNLOCK_QUEUE(pqueue);
+        wake_pending();
+    }
+}
+
+// -------- BOUNDED MODE HELPER FUNCTIONS IMPLEMENTATION ----------
+// In bounded mode every item holds a slot from the moment its enqueue reserves it until it is removed.
+// Producers that find no free slot wait in prod_queue, and slots are handed to them the same way items are handed to th_queue
+
+size_t try_reserve_slots(Queue* pqueue, size_t n)
+{
+    size_t used;
+    size_t got;
+
+    used = atomic_load_explicit(&pqueue->reserved, memory_order_relaxed);
+    do
+    {
+        if(used >= pqueue->capacity) // queue is full
+        {
+            return 0;
+        }
+        got = pqueue->capacity - used < n ? pqueue->capacity - used : n;
+    } while(!atomic_compare_exchange_weak_explicit(&pqueue->reserved, &used, used + got, memory_order_acq_rel, memory_order_relaxed));
+    return got;
+}
+
+size_t reserve_slots(Queue* pqueue, size_t n, const struct timespec* deadline)
+{
+    ThreadNode* pth;
+    size_t got;
+
+    // fast path, taken only when no producer is waiting so that waiting producers keep their FIFO order
+    if(atomic_load_explicit(&pqueue->prod_queue.waiting, memory_order_acquire) == 0 && (got = try_reserve_slots(pqueue, n)) > 0)
+    {
+        return got;
+    }
+
+    LOCK_QUEUE(pqueue);
+    pth = get_th_node();
+    append_th_node(&pqueue->prod_queue, pth);
+    atomic_fetch_add(&pqueue->blocked, 1);
+    // a slot may have been freed by a consumer that didn't see us waiting yet, same as in dequeue
+    atomic_thread_fence(memory_order_seq_cst);
+    hand_slots_to_producers(pqueue);
+    wake_pending(); // we are about to wait on the lock, so nobody must wait for our signals meanwhile
+    while(!pth->delivered)
+    {
+        if(deadline == NULL)
+        {
+            WAIT_QUEUE(&(pth->cond_var), pqueue);
+        }
+        else if(TIMEDWAIT_QUEUE(&(pth->cond_var), pqueue, deadline) == thrd_timedout && !pth->delivered)
+        {
+            // gave up, but only if no slot was handed to us while we were timing out
+            remove_th_node(&pqueue->prod_queue, pth);
+            UNLOCK_QUEUE(pqueue);
+            atomic_fetch_sub(&pqueue->blocked, 1);
+            return 0;
+        }
+    }
+    UNLOCK_QUEUE(pqueue);
+    atomic_fetch_sub(&pqueue->blocked, 1);
+    // a waiting producer is handed a single slot, unless it was woken because the queue is being destroyed
+    return pth->pdata == QUEUE_CLOSED ? 0 : 1;
+}
+
+void hand_slots_to_producers(Queue* pqueue)
 {
-    bool ret;
-    ItemNode* pret = NULL;
+    ThreadNode* pth;
 
-    mtx_lock(&queue.mutex);
-    if(queue.pfront == NULL)  // no item to dequeue
+    while(pqueue->prod_queue.pfirst != NULL && try_reserve_slots(pqueue, 1) == 1)
     {
-        ret = false;
-        mtx_unlock(&queue.mutex);
-        return ret;
+        pth = remove_first_th_node(&pqueue->prod_queue);
+        pth->delivered = true;
+        wake_later(pth);
     }
-    
-    else // there is an item to dequeue
+}
+
+void return_slots(Queue* pqueue, size_t n)
+{
+    if(pqueue->capacity == 0 || n == 0)
     {
-        // remove front of queue
-        pret = remove_first_item_node(&queue);
-        // inserting popped item's data into returned_ptr so that we can free popped item
-        *returned_ptr = pret->pdata;
-        ret = true;
-        free(pret);
-        mtx_unlock(&queue.mutex);
-        return ret;
+        return;
     }
+    atomic_fetch_sub_explicit(&pqueue->reserved, n, memory_order_acq_rel);
+    hand_slots_to_producers(pqueue);
+}
+
+void release_slots(Queue* pqueue, size_t n)
+{
+    if(pqueue->capacity == 0 || n == 0)
+    {
+        return;
+    }
+    atomic_fetch_sub_explicit(&pqueue->reserved, n, memory_order_acq_rel);
+    // pairs with the fence in reserve_slots, like the one in notify_waiters
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&pqueue->prod_queue.waiting, memory_order_relaxed) > 0) // producers are waiting
+    {
+        LOCK_QUEUE(pqueue);
+        hand_slots_to_producers(pqueue);
+        UNLOCK_QUEUE(pqueue);
+        wake_pending();
+    }
+}
+
+bool enqueue_reserved(Queue* pqueue, void* pdata, unsigned level, const struct timespec* deadline)
+{
+    if(pqueue->capacity > 0 && reserve_slots(pqueue, 1, deadline) == 0)
+    {
+        return false;
+    }
+    // insert item into queue without taking the lock
+    push_items(pqueue, level, &pdata, 1);
+    notify_waiters(pqueue);
+    return true;
+}
+
+// -------- SCHEDULED ITEMS HELPER FUNCTIONS IMPLEMENTATION ----------
+// Items scheduled with enqueueAt wait in a timing wheel (under queue.mutex) until they are due, so pending items cost
+// no thread and scheduling one is O(1) however many are pending. Nobody runs the wheel in the background: consumers
+// release the items that are due when they come to dequeue, and the oldest waiting thread (the one the next item goes to)
+// parks only until the wheel has to move next, so that items become visible on time even when nobody else comes by
+
+uint64_t wall_ns(void)
+{
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+    return timespec_to_ns(&ts);
+}
+
+uint64_t timespec_to_ns(const struct timespec* pts)
+{
+    return (uint64_t)pts->tv_sec * 1000000000u + (uint64_t)pts->tv_nsec;
+}
+
+struct timespec ns_to_timespec(uint64_t ns)
+{
+    return (struct timespec){.tv_sec = (time_t)(ns / 1000000000u), .tv_nsec = (long)(ns % 1000000000u)};
+}
+
+void wheel_insert(TimerWheel* pwheel, TimerNode* pnode)
+{
+    unsigned level;
+    unsigned digit;
+    TimerSlot* pslot;
+
+    level = (63 - (unsigned)__builtin_clzll(pnode->due ^ pwheel->now)) / WHEEL_BITS;
+    digit = (unsigned)(pnode->due >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+    pslot = &pwheel->slots[level][digit];
+    pnode->pnext = NULL;
+    if(pslot->pfirst == NULL)
+    {
+        pslot->pfirst = pnode;
+    }
+    else
+    {
+        pslot->plast->pnext = pnode;
+    }
+    pslot->plast = pnode;
+    pwheel->occupied[level] |= 1ull << digit;
+}
+
+uint64_t wheel_next_event(TimerWheel* pwheel, unsigned* plevel)
+{
+    unsigned level;
+    unsigned shift;
+    uint64_t base;
+
+    // slots of a level are only ever ahead of now within the current slot of the level above, so the first occupied
+    // slot of the lowest occupied level is the next one reached
+    for(level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if(pwheel->occupied[level] != 0)
+        {
+            shift = level * WHEEL_BITS;
+            base = shift + WHEEL_BITS >= 64 ? 0 : pwheel->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+            *plevel = level;
+            return base + ((uint64_t)__builtin_ctzll(pwheel->occupied[level]) << shift);
+        }
+    }
+    return UINT64_MAX;
+}
+
+TimerNode* wheel_advance(TimerWheel* pwheel, uint64_t tick)
+{
+    TimerNode* pdue_first = NULL;
+    TimerNode* pdue_last = NULL;
+    TimerNode* pnode;
+    TimerNode* pnext;
+    TimerSlot* pslot;
+    unsigned level = 0;
+    unsigned digit;
+    uint64_t event;
+
+    // jumping from slot to slot, the empty stretches in between cost nothing
+    while((event = wheel_next_event(pwheel, &level)) <= tick)
+    {
+        pwheel->now = event;
+        digit = (unsigned)(event >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+        pslot = &pwheel->slots[level][digit];
+        pnode = pslot->pfirst;
+        pslot->pfirst = NULL;
+        pslot->plast = NULL;
+        pwheel->occupied[level] &= ~(1ull << digit);
+        for(; pnode != NULL; pnode = pnext)
+        {
+            pnext = pnode->pnext;
+            if(pnode->due > event) // a slot of a higher level, the node moves down
+            {
+                wheel_insert(pwheel, pnode);
+                continue;
+            }
+            pnode->pnext = NULL;
+            if(pdue_first == NULL)
+            {
+                pdue_first = pnode;
+            }
+            else
+            {
+                pdue_last->pnext = pnode;
+            }
+            pdue_last = pnode;
+            pwheel->count--;
+        }
+    }
+    // no slot lies between the last one reached and tick, so moving now past them changes no node's place
+    if(tick > pwheel->now)
+    {
+        pwheel->now = tick;
+    }
+    return pdue_first;
+}
+
+void free_timer_wheel(TimerWheel* pwheel)
+{
+    TimerNode* pnode;
+    TimerNode* pnext;
+    unsigned level;
+    unsigned digit;
+
+    if(pwheel == NULL)
+    {
+        return;
+    }
+    // items that are still scheduled go away like items that are still in the queue
+    for(level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for(digit = 0; digit < WHEEL_SLOTS; digit++)
+        {
+            for(pnode = pwheel->slots[level][digit].pfirst; pnode != NULL; pnode = pnext)
+            {
+                pnext = pnode->pnext;
+                free(pnode);
+            }
+        }
+    }
+    for(pnode = pwheel->pfree; pnode != NULL; pnode = pnext)
+    {
+        pnext = pnode->pnext;
+        free(pnode);
+    }
+    free(pwheel);
+}
+
+void update_next_due(Queue* pqueue)
+{
+    uint64_t event;
+    unsigned level;
+
+    event = wheel_next_event(pqueue->pwheel, &level);
+    atomic_store_explicit(&pqueue->next_due, event == UINT64_MAX ? UINT64_MAX : event * TIMER_TICK_NS, memory_order_relaxed);
+}
+
+void wake_timekeeper(Queue* pqueue)
+{
+    if(pqueue->pwheel != NULL && pqueue->pwheel->count > 0 && pqueue->th_queue.pfirst != NULL)
+    {
+        wake_later(pqueue->th_queue.pfirst);
+    }
+}
+
+void release_due_items(Queue* pqueue)
+{
+    TimerNode* pnode;
+    TimerNode* pnext;
+
+    if(pqueue->pwheel == NULL)
+    {
+        return;
+    }
+    // in bounded mode the due items already hold the slots enqueue_at reserved for them
+    for(pnode = wheel_advance(pqueue->pwheel, wall_ns() / TIMER_TICK_NS); pnode != NULL; pnode = pnext)
+    {
+        pnext = pnode->pnext;
+        push_items(pqueue, 0, &pnode->pdata, 1);
+        pnode->pnext = pqueue->pwheel->pfree;
+        pqueue->pwheel->pfree = pnode;
+    }
+    update_next_due(pqueue);
+    return_slots(pqueue, hand_items_to_waiters(pqueue));
+}
+
+void check_due_items(Queue* pqueue)
+{
+    uint64_t due;
+
+    due = atomic_load_explicit(&pqueue->next_due, memory_order_relaxed);
+    if(due == UINT64_MAX || due > wall_ns())
+    {
+        return;
+    }
+    LOCK_QUEUE(pqueue);
+    release_due_items(pqueue);
+    UNLOCK_QUEUE(pqueue);
+    wake_pending();
+}
+
+void enqueue_at(Queue* pqueue, void* pdata, uint64_t due_ns)
+{
+    TimerNode* pnode;
+    uint64_t due;
+    uint64_t next_due;
+
+    // the item holds its slot while it is scheduled (none is only handed out while the queue is being destroyed)
+    if(pqueue->capacity > 0 && reserve_slots(pqueue, 1, NULL) == 0)
+    {
+        return;
+    }
+    LOCK_QUEUE(pqueue);
+    if(pqueue->pwheel == NULL)
+    {
+        pqueue->pwheel = (TimerWheel*)calloc(1, sizeof(TimerWheel)); // No error checking since we assume calloc never fails
+        pqueue->pwheel->now = wall_ns() / TIMER_TICK_NS;
+    }
+    // rounding up, so that an item never comes out before its time
+    due = due_ns / TIMER_TICK_NS + (due_ns % TIMER_TICK_NS != 0);
+    if(due <= pqueue->pwheel->now) // already due
+    {
+        UNLOCK_QUEUE(pqueue);
+        push_items(pqueue, 0, &pdata, 1);
+        notify_waiters(pqueue);
+        return;
+    }
+    pnode = pqueue->pwheel->pfree;
+    if(pnode != NULL)
+    {
+        pqueue->pwheel->pfree = pnode->pnext;
+    }
+    else
+    {
+        pnode = (TimerNode*)malloc(sizeof(TimerNode)); // No error checking since we assume malloc never fails
+    }
+    pnode->pdata = pdata;
+    pnode->due = due;
+    wheel_insert(pqueue->pwheel, pnode);
+    pqueue->pwheel->count++;
+    next_due = atomic_load_explicit(&pqueue->next_due, memory_order_relaxed);
+    update_next_due(pqueue);
+    if(atomic_load_explicit(&pqueue->next_due, memory_order_relaxed) < next_due) // the timekeeper sleeps for too long now
+    {
+        wake_timekeeper(pqueue);
+    }
+    UNLOCK_QUEUE(pqueue);
+    wake_pending();
+}
+
+const struct timespec* wake_time(Queue* pqueue, ThreadNode* pth, const struct timespec* deadline, struct timespec* pdue)
+{
+    uint64_t due;
+
+    due = atomic_load_explicit(&pqueue->next_due, memory_order_relaxed);
+    if(pth != pqueue->th_queue.pfirst || due == UINT64_MAX || (deadline != NULL && timespec_to_ns(deadline) <= due))
+    {
+        return deadline;
+    }
+    *pdue = ns_to_timespec(due);
+    return pdue;
+}
+
+// -------- TAGGED ITEMS HELPER FUNCTIONS IMPLEMENTATION ----------
+// Tagged items are kept apart from the lock-free list, in a list per tag under queue.mutex, and only dequeueTag of the
+// same tag sees them. Threads waiting for a tag wait in the entry of that tag, so an enqueue wakes a thread that wants
+// its item or none at all, and items of a tag come out in the order they were enqueued
+
+size_t tag_hash(uint32_t tag)
+{
+    // the finalizer of murmur3, every bit of the tag affects the low bits the table index is taken from,
+    // so tags that only differ in their high bits (say a type code in the upper half) don't share a probe chain
+    tag ^= tag >> 16;
+    tag *= 0x85ebca6bu;
+    tag ^= tag >> 13;
+    tag *= 0xc2b2ae35u;
+    tag ^= tag >> 16;
+    return (size_t)tag;
+}
+
+TagEntry* find_tag(Queue* pqueue, uint32_t tag, bool create)
+{
+    TagTable* ptags;
+    TagEntry* pentry;
+    size_t i;
+
+    ptags = pqueue->ptags;
+    if(ptags == NULL)
+    {
+        if(!create)
+        {
+            return NULL;
+        }
+        ptags = (TagTable*)malloc(sizeof(TagTable)); // No error checking since we assume malloc never fails
+        ptags->entries = (TagEntry**)calloc(TAG_TABLE_MIN, sizeof(TagEntry*)); // No error checking since we assume calloc never fails
+        ptags->capacity = TAG_TABLE_MIN;
+        ptags->used = 0;
+        ptags->pfree = NULL;
+        pqueue->ptags = ptags;
+    }
+    for(i = tag_hash(tag) & (ptags->capacity - 1); ptags->entries[i] != NULL; i = (i + 1) & (ptags->capacity - 1))
+    {
+        if(ptags->entries[i]->tag == tag)
+        {
+            return ptags->entries[i];
+        }
+    }
+    if(!create)
+    {
+        return NULL;
+    }
+    pentry = (TagEntry*)malloc(sizeof(TagEntry)); // No error checking since we assume malloc never fails
+    pentry->tag = tag;
+    pentry->pfirst = NULL;
+    pentry->plast = NULL;
+    pentry->waiters.pfirst = NULL;
+    pentry->waiters.plast = NULL;
+    atomic_init(&pentry->waiters.waiting, 0);
+    ptags->entries[i] = pentry;
+    ptags->used++;
+    if(ptags->used * 2 > ptags->capacity)
+    {
+        grow_tag_table(ptags);
+    }
+    return pentry;
+}
+
+void grow_tag_table(TagTable* ptags)
+{
+    TagEntry** old_entries;
+    size_t old_capacity;
+    size_t i;
+    size_t j;
+
+    old_entries = ptags->entries;
+    old_capacity = ptags->capacity;
+    ptags->capacity *= 2;
+    ptags->entries = (TagEntry**)calloc(ptags->capacity, sizeof(TagEntry*)); // No error checking since we assume calloc never fails
+    for(i = 0; i < old_capacity; i++)
+    {
+        if(old_entries[i] == NULL)
+        {
+            continue;
+        }
+        for(j = tag_hash(old_entries[i]->tag) & (ptags->capacity - 1); ptags->entries[j] != NULL; j = (j + 1) & (ptags->capacity - 1))
+        {
+            // looking for a free slot
+        }
+        ptags->entries[j] = old_entries[i];
+    }
+    free(old_entries);
+}
+
+void free_tag_table(TagTable* ptags)
+{
+    TagNode* pnode;
+    TagNode* pnext;
+    size_t i;
+
+    if(ptags == NULL)
+    {
+        return;
+    }
+    // items that are still in the lists go away like items that are still in the queue
+    for(i = 0; i < ptags->capacity; i++)
+    {
+        if(ptags->entries[i] == NULL)
+        {
+            continue;
+        }
+        for(pnode = ptags->entries[i]->pfirst; pnode != NULL; pnode = pnext)
+        {
+            pnext = pnode->pnext;
+            free(pnode);
+        }
+        free(ptags->entries[i]);
+    }
+    for(pnode = ptags->pfree; pnode != NULL; pnode = pnext)
+    {
+        pnext = pnode->pnext;
+        free(pnode);
+    }
+    free(ptags->entries);
+    free(ptags);
+}
+
+void enqueue_tagged(Queue* pqueue, void* pdata, uint32_t tag)
+{
+    TagEntry* pentry;
+    TagNode* pnode;
+    ThreadNode* pth;
+
+    if(pqueue->capacity > 0 && reserve_slots(pqueue, 1, NULL) == 0) // the queue is being destroyed
+    {
+        return;
+    }
+    LOCK_QUEUE(pqueue);
+    pentry = find_tag(pqueue, tag, true);
+    if(pentry->waiters.pfirst != NULL) // someone is waiting for this tag, the item is theirs
+    {
+        pth = remove_first_th_node(&pentry->waiters);
+        atomic_fetch_sub(&pqueue->tag_waiting, 1);
+        pth->pdata = pdata;
+        pth->delivered = true;
+        wake_later(pth);
+        atomic_fetch_add_explicit(&pqueue->visited_stripes[thread_slot()].count, 1, memory_order_relaxed);
+        return_slots(pqueue, 1);
+    }
+    else
+    {
+        pnode = pqueue->ptags->pfree;
+        if(pnode != NULL)
+        {
+            pqueue->ptags->pfree = pnode->pnext;
+        }
+        else
+        {
+            pnode = (TagNode*)malloc(sizeof(TagNode)); // No error checking since we assume malloc never fails
+        }
+        pnode->pdata = pdata;
+        pnode->pnext = NULL;
+        if(pentry->pfirst == NULL)
+        {
+            pentry->pfirst = pnode;
+        }
+        else
+        {
+            pentry->plast->pnext = pnode;
+        }
+        pentry->plast = pnode;
+        atomic_fetch_add(&pqueue->tagged, 1);
+    }
+    UNLOCK_QUEUE(pqueue);
+    wake_pending();
+}
+
+bool dequeue_tag(Queue* pqueue, uint32_t tag, void** ppdata, bool wait)
+{
+    TagEntry* pentry;
+    TagNode* pnode;
+    ThreadNode* pth;
+
+    LOCK_QUEUE(pqueue);
+    pentry = find_tag(pqueue, tag, wait);
+    if(pentry != NULL && pentry->pfirst != NULL)
+    {
+        pnode = pentry->pfirst;
+        pentry->pfirst = pnode->pnext;
+        if(pentry->pfirst == NULL)
+        {
+            pentry->plast = NULL;
+        }
+        *ppdata = pnode->pdata;
+        pnode->pnext = pqueue->ptags->pfree;
+        pqueue->ptags->pfree = pnode;
+        atomic_fetch_sub(&pqueue->tagged, 1);
+        atomic_fetch_add_explicit(&pqueue->visited_stripes[thread_slot()].count, 1, memory_order_relaxed);
+        return_slots(pqueue, 1);
+        UNLOCK_QUEUE(pqueue);
+        wake_pending();
+        return true;
+    }
+    if(!wait || atomic_load_explicit(&pqueue->closed, memory_order_relaxed))
+    {
+        if(atomic_load_explicit(&pqueue->closed, memory_order_relaxed))
+        {
+            *ppdata = QUEUE_CLOSED;
+        }
+        UNLOCK_QUEUE(pqueue);
+        return false;
+    }
+    // waiting in the entry of our tag, the enqueue of the next item of the tag pops us and hands it over
+    pth = get_th_node();
+    append_th_node(&pentry->waiters, pth);
+    atomic_fetch_add(&pqueue->tag_waiting, 1);
+    atomic_fetch_add(&pqueue->blocked, 1);
+    while(!pth->delivered)
+    {
+        WAIT_QUEUE(&(pth->cond_var), pqueue);
+    }
+    *ppdata = pth->pdata;
+    UNLOCK_QUEUE(pqueue);
+    atomic_fetch_sub(&pqueue->blocked, 1);
+    return *ppdata != QUEUE_CLOSED;
+}
+
+// -------- BLOCKING DEQUEUE IMPLEMENTATION ----------
+// Items often arrive very shortly after a consumer found the queue empty, so before parking (a futex sleep and a wakeup)
+// the consumer polls the queue for up to spin_budget rounds. The budget doubles whenever spinning found an item
+// and halves whenever it didn't, so spinning stops costing CPU on a queue that stays empty for long
+bool poll_for_item(Queue* pqueue, void** ppdata)
+{
+    size_t budget;
+    size_t limit;
+    size_t i;
+
+    limit = atomic_load_explicit(&pqueue->spin_limit, memory_order_relaxed);
+    budget = atomic_load_explicit(&pqueue->spin_budget, memory_order_relaxed);
+    if(budget > limit)
+    {
+        budget = limit;
+    }
+    for(i = 1; i <= budget; i++)
+    {
+        // stop once someone is waiting (unless barging), taking an item now would jump ahead of it
+        if(owed_to_waiters(pqueue))
+        {
+            return false;
+        }
+        // checking size first only reads, so spinning doesn't bounce the front between consumers
+        if(item_count(pqueue) > 0 && take_items(pqueue, ppdata, 1) == 1)
+        {
+            budget = budget * 2 < limit ? budget * 2 : limit;
+            atomic_store_explicit(&pqueue->spin_budget, budget, memory_order_relaxed);
+            return true;
+        }
+        if(i % SPIN_YIELD_EVERY == 0)
+        {
+            thrd_yield();
+        }
+        else
+        {
+            CPU_RELAX();
+        }
+    }
+    // the budget may be 0 after the limit was lowered, it stays at SPIN_MIN so raising the limit again brings spinning back
+    budget = budget / 2 > SPIN_MIN ? budget / 2 : SPIN_MIN;
+    atomic_store_explicit(&pqueue->spin_budget, budget, memory_order_relaxed);
+    return false;
+}
+
+// In strict FIFO mode every item that arrives while threads are parked is handed to the oldest of them, which costs a
+// wakeup (and a context switch) even when a consumer that is running could have taken it right away.
+// In barging mode a spinning consumer counts itself in spinning, and enqueue leaves its items to the spinners
+// instead of waking a parked thread, so parked threads only get items that running consumers don't take
+bool spin_for_item(Queue* pqueue, void** ppdata)
+{
+    bool barging;
+    bool got_item;
+
+    barging = atomic_load_explicit(&pqueue->policy, memory_order_relaxed) == QUEUE_BARGING;
+    if(!barging)
+    {
+        return poll_for_item(pqueue, ppdata);
+    }
+    atomic_fetch_add(&pqueue->spinning, 1);
+    got_item = poll_for_item(pqueue, ppdata);
+    stop_spinning(pqueue, got_item);
+    return got_item;
+}
+
+bool dequeue_timed(Queue* pqueue, void** ppdata, const struct timespec* deadline)
+{
+    ThreadNode* pth;
+    const struct timespec* pwake;
+    struct timespec due;
+
+    check_due_items(pqueue);
+    // fast path, taken only when no thread is waiting so that waiting threads keep their FIFO order (or always when barging)
+    // (there is no point in spinning for items once the queue is closed)
+    if(!owed_to_waiters(pqueue) &&
+       (take_items(pqueue, ppdata, 1) == 1 ||
+        (!atomic_load_explicit(&pqueue->closed, memory_order_relaxed) && spin_for_item(pqueue, ppdata))))
+    {
+        release_slots(pqueue, 1);
+        return true;
+    }
+
+    LOCK_QUEUE(pqueue);
+    // get the thread node of the calling thread, to be associated with this dequeue action, and append it to th_queue
+    pth = get_th_node();
+    append_th_node(&pqueue->th_queue, pth);
+    atomic_fetch_add(&pqueue->blocked, 1);
+    // an item may have been inserted by an enqueue that didn't see us waiting yet, so we hand it out ourselves
+    // (it goes to the oldest waiting thread, which is not necessarily us)
+    atomic_thread_fence(memory_order_seq_cst);
+    return_slots(pqueue, hand_items_to_waiters(pqueue));
+    if(atomic_load_explicit(&pqueue->closed, memory_order_relaxed))
+    {
+        wake_closed(pqueue); // there was no item left for us
+    }
+    wake_pending(); // we are about to wait on the lock, so nobody must wait for our signals meanwhile
+    // put thread to sleep so it can be signaled by enqueue when another item is inserted
+    while(!pth->delivered)
+    {
+        // the oldest waiting thread also wakes up when the next scheduled item is due
+        pwake = wake_time(pqueue, pth, deadline, &due);
+        if(pwake == NULL)
+        {
+            WAIT_QUEUE(&(pth->cond_var), pqueue);
+        }
+        else if(TIMEDWAIT_QUEUE(&(pth->cond_var), pqueue, pwake) == thrd_timedout && !pth->delivered)
+        {
+            if(pwake == &due)
+            {
+                // releasing the scheduled items that are due, the first of them is ours
+                release_due_items(pqueue);
+                wake_pending();
+                continue;
+            }
+            // timed out, and no enqueue handed us an item while we were timing out (checked under the lock, so none can now).
+            // pth may be anywhere in th_queue by now, not necessarily first
+            remove_th_node(&pqueue->th_queue, pth);
+            wake_timekeeper(pqueue); // in case we kept time for the scheduled items
+            UNLOCK_QUEUE(pqueue);
+            atomic_fetch_sub(&pqueue->blocked, 1);
+            wake_pending();
+            return false;
+        }
+    }
+    // pth is popped from th_queue by whoever handed it the item, visited was updated when the item was removed
+    // now transferring data associated with dequeued item to be returned
+    *ppdata = pth->pdata;
+    UNLOCK_QUEUE(pqueue);
+    atomic_fetch_sub(&pqueue->blocked, 1);
+    // pth stays with the thread for its next dequeue
+    return *ppdata != QUEUE_CLOSED;
+}
+
+// dequeueAny puts a node of its own in the th_queue of every queue, all of them pointing to one SelectWaiter that the thread
+// waits on, so an enqueue to any of the queues hands its item over exactly like to a thread in dequeue (in FIFO order with
+// the other waiting threads). The first queue that does sets done, the other queues drop their stale nodes when they
+// come to them, and the thread removes whatever nodes are left once it is awake
+void* dequeue_any(Queue** pqueues, size_t n, size_t* pwhich)
+{
+    SelectWaiter select;
+    ThreadNode* pths;
+    size_t registered;
+    size_t i;
+    uint64_t due;
+    struct timespec wake;
+    void* pdata;
+    size_t closed = n;
+
+    // an item that is there already, taken from the first queue (in the caller's order) that has one,
+    // and only if none has, a closed queue that is empty
+    for(i = 0; i < n; i++)
+    {
+        if(queue_try_dequeue(pqueues[i], &pdata))
+        {
+            *pwhich = i;
+            return pdata;
+        }
+        if(pdata == QUEUE_CLOSED && closed == n)
+        {
+            closed = i;
+        }
+    }
+    if(closed < n)
+    {
+        *pwhich = closed;
+        return QUEUE_CLOSED;
+    }
+    if(n == 0)
+    {
+        return NULL;
+    }
+
+    mtx_init(&select.mutex, mtx_plain);
+    cnd_init(&select.cond_var);
+    atomic_init(&select.done, false);
+    select.pdata = NULL;
+    select.which = 0;
+    pths = (ThreadNode*)malloc(n * sizeof(ThreadNode)); // No error checking since we assume malloc never fails
+    // waiting in one queue after the other, and the way dequeue does: an item that came in before we were seen waiting
+    // is handed out by ourselves. Once one of them is ours there is no need to wait in the rest
+    for(registered = 0; registered < n && !atomic_load(&select.done); registered++)
+    {
+        pths[registered].pdata = NULL;
+        pths[registered].delivered = false;
+        atomic_init(&pths[registered].wakes_pending, 0);
+        pths[registered].pselect = &select;
+        pths[registered].index = registered;
+        pths[registered].pnext = NULL;
+        LOCK_QUEUE(pqueues[registered]);
+        append_th_node(&pqueues[registered]->th_queue, &pths[registered]);
+        atomic_fetch_add(&pqueues[registered]->blocked, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        return_slots(pqueues[registered], hand_items_to_waiters(pqueues[registered]));
+        if(atomic_load_explicit(&pqueues[registered]->closed, memory_order_relaxed))
+        {
+            wake_closed(pqueues[registered]);
+        }
+        UNLOCK_QUEUE(pqueues[registered]);
+        wake_pending();
+    }
+
+    LOCK_MUTEX(&select.mutex);
+    while(!atomic_load_explicit(&select.done, memory_order_relaxed))
+    {
+        // we may be first in a queue with scheduled items, and then no other thread keeps time for them
+        due = UINT64_MAX;
+        for(i = 0; i < registered; i++)
+        {
+            if(atomic_load_explicit(&pqueues[i]->next_due, memory_order_relaxed) < due)
+            {
+                due = atomic_load_explicit(&pqueues[i]->next_due, memory_order_relaxed);
+            }
+        }
+        if(due == UINT64_MAX)
+        {
+            WAIT_MUTEX(&select.cond_var, &select.mutex);
+            continue;
+        }
+        wake = ns_to_timespec(due);
+        if(TIMEDWAIT_MUTEX(&select.cond_var, &select.mutex, &wake) == thrd_timedout &&
+           !atomic_load_explicit(&select.done, memory_order_relaxed))
+        {
+            // releasing the items hands them out, which takes select.mutex
+            UNLOCK_MUTEX(&select.mutex);
+            for(i = 0; i < registered; i++)
+            {
+                check_due_items(pqueues[i]);
+            }
+            LOCK_MUTEX(&select.mutex);
+        }
+    }
+    UNLOCK_MUTEX(&select.mutex);
+
+    // leaving the queues that didn't hand us the item and haven't dropped our node yet
+    for(i = 0; i < registered; i++)
+    {
+        LOCK_QUEUE(pqueues[i]);
+        if(!pths[i].delivered)
+        {
+            remove_th_node(&pqueues[i]->th_queue, &pths[i]);
+            wake_timekeeper(pqueues[i]); // in case we kept time for the scheduled items
+        }
+        UNLOCK_QUEUE(pqueues[i]);
+        atomic_fetch_sub(&pqueues[i]->blocked, 1);
+        wake_pending();
+    }
+    // whoever handed us the item (or woke us as the timekeeper) may not have signaled yet
+    for(i = 0; i < registered; i++)
+    {
+        while(atomic_load_explicit(&pths[i].wakes_pending, memory_order_acquire) > 0)
+        {
+            thrd_yield();
+        }
+    }
+    free(pths);
+    cnd_destroy(&select.cond_var);
+    mtx_destroy(&select.mutex);
+    *pwhich = select.which;
+    return select.pdata;
+}
+
+// -------- INSTRUMENTATION HELPER FUNCTIONS IMPLEMENTATION ----------
+// Histograms are log-linear like HDR histograms: values below 2^QUEUE_HIST_SUB_BITS get a bucket each, and every
+// power of two above that is cut into 2^QUEUE_HIST_SUB_BITS buckets, so a bucket is never wider than 1/8 of its values
+
+unsigned hist_bucket(uint64_t ns)
+{
+    unsigned exp = QUEUE_HIST_SUB_BITS;
+
+    if(ns < (1u << QUEUE_HIST_SUB_BITS))
+    {
+        return (unsigned)ns;
+    }
+    while(exp < 63 && (ns >> (exp + 1)) != 0) // exp = position of the highest set bit
+    {
+        exp++;
+    }
+    return ((exp - QUEUE_HIST_SUB_BITS + 1) << QUEUE_HIST_SUB_BITS) + (unsigned)((ns >> (exp - QUEUE_HIST_SUB_BITS)) & ((1u << QUEUE_HIST_SUB_BITS) - 1));
+}
+
+uint64_t hist_bucket_low(unsigned bucket)
+{
+    unsigned exp;
+
+    if(bucket < (1u << QUEUE_HIST_SUB_BITS))
+    {
+        return bucket;
+    }
+    exp = (bucket >> QUEUE_HIST_SUB_BITS) + QUEUE_HIST_SUB_BITS - 1;
+    return ((uint64_t)(1u << QUEUE_HIST_SUB_BITS) + (bucket & ((1u << QUEUE_HIST_SUB_BITS) - 1))) << (exp - QUEUE_HIST_SUB_BITS);
+}
+
+#ifdef QUEUE_INSTRUMENT
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+#ifdef TIME_MONOTONIC
+    timespec_get(&ts, TIME_MONOTONIC);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void init_stats(void)
+{
+    mtx_init(&stats_mutex, mtx_plain);
+    tss_create(&stats_key, free_thread_stats);
+}
+
+static void free_thread_stats(void* pstats)
+{
+    ThreadStats** pplink;
+    uint64_t max_ns;
+    int kind;
+    unsigned i;
+
+    // the thread is gone, so its histograms no longer change, and snapshots hold stats_mutex while they read them
+    mtx_lock(&stats_mutex);
+    pplink = &all_stats;
+    while(*pplink != pstats)
+    {
+        pplink = &(*pplink)->pnext;
+    }
+    *pplink = ((ThreadStats*)pstats)->pnext;
+    for(kind = 0; kind < HIST_KINDS; kind++)
+    {
+        atomic_fetch_add_explicit(&exited_stats.count[kind], atomic_load_explicit(&((ThreadStats*)pstats)->count[kind], memory_order_relaxed), memory_order_relaxed);
+        atomic_fetch_add_explicit(&exited_stats.total_ns[kind], atomic_load_explicit(&((ThreadStats*)pstats)->total_ns[kind], memory_order_relaxed), memory_order_relaxed);
+        max_ns = atomic_load_explicit(&((ThreadStats*)pstats)->max_ns[kind], memory_order_relaxed);
+        if(max_ns > atomic_load_explicit(&exited_stats.max_ns[kind], memory_order_relaxed))
+        {
+            atomic_store_explicit(&exited_stats.max_ns[kind], max_ns, memory_order_relaxed);
+        }
+        for(i = 0; i < QUEUE_HIST_BUCKETS; i++)
+        {
+            atomic_fetch_add_explicit(&exited_stats.buckets[kind][i], atomic_load_explicit(&((ThreadStats*)pstats)->buckets[kind][i], memory_order_relaxed), memory_order_relaxed);
+        }
+    }
+    mtx_unlock(&stats_mutex);
+    free(pstats);
+    pstats_self = NULL; // in case a later destructor of the thread still records something, it gets new histograms
+}
+
+static void record_latency(int kind, uint64_t ns)
+{
+    ThreadStats* pstats;
+    _Atomic uint64_t* pbucket;
+
+    if(ns > (uint64_t)INT64_MAX) // the clock went backwards (TIME_UTC can), counting it as 0
+    {
+        ns = 0;
+    }
+    if(pstats_self == NULL)
+    {
+        call_once(&stats_once, init_stats);
+        pstats_self = (ThreadStats*)calloc(1, sizeof(ThreadStats)); // No error checking since we assume calloc never fails
+        tss_set(stats_key, pstats_self);
+        mtx_lock(&stats_mutex);
+        pstats_self->pnext = all_stats->pnext; // exited_stats stays first
+        all_stats->pnext = pstats_self;
+        mtx_unlock(&stats_mutex);
+    }
+    pstats = pstats_self;
+    // single writer, so a load and a store are enough, the atomics only keep snapshots free of torn reads
+    pbucket = &pstats->buckets[kind][hist_bucket(ns)];
+    atomic_store_explicit(pbucket, atomic_load_explicit(pbucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&pstats->count[kind], atomic_load_explicit(&pstats->count[kind], memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&pstats->total_ns[kind], atomic_load_explicit(&pstats->total_ns[kind], memory_order_relaxed) + ns, memory_order_relaxed);
+    if(ns > atomic_load_explicit(&pstats->max_ns[kind], memory_order_relaxed))
+    {
+        atomic_store_explicit(&pstats->max_ns[kind], ns, memory_order_relaxed);
+    }
+}
+
+static void instr_lock(mtx_t* pmutex)
+{
+    uint64_t start;
+
+    start = now_ns();
+    mtx_lock(pmutex);
+    lock_taken_at = now_ns();
+    record_latency(HIST_LOCK_WAIT, lock_taken_at - start);
+}
+
+static void instr_unlock(mtx_t* pmutex)
+{
+    record_latency(HIST_LOCK_HOLD, now_ns() - lock_taken_at);
+    mtx_unlock(pmutex);
+}
+
+static int instr_wait(cnd_t* pcond, mtx_t* pmutex, const struct timespec* deadline)
+{
+    uint64_t parked_at;
+    int ret;
+
+    // the lock is released while parked, so the hold time stops here and starts again once we are woken with it
+    parked_at = now_ns();
+    record_latency(HIST_LOCK_HOLD, parked_at - lock_taken_at);
+    ret = deadline == NULL ? cnd_wait(pcond, pmutex) : cnd_timedwait(pcond, pmutex, deadline);
+    lock_taken_at = now_ns();
+    record_latency(HIST_PARKED, lock_taken_at - parked_at);
+    return ret;
+}
+#endif
+
+// -------- QUEUE INSTANCE HELPER FUNCTIONS IMPLEMENTATION ----------
+void init_queue(Queue* pqueue, size_t capacity, size_t nshards)
+{
+    uint32_t first;
+    size_t i;
+
+    // Initializing queue
+    init_segment_pool(&pqueue->pool);
+    mtx_init(&pqueue->mutex, mtx_plain);
+    atomic_init(&pqueue->size, 0);
+    atomic_init(&pqueue->visited, 0);
+    for(i = 0; i < TH_SLOTS; i++)
+    {
+        atomic_init(&pqueue->visited_stripes[i].count, 0);
+    }
+    pqueue->capacity = capacity;
+    atomic_init(&pqueue->reserved, 0);
+    atomic_init(&pqueue->spin_limit, SPIN_DEFAULT_LIMIT);
+    atomic_init(&pqueue->spin_budget, SPIN_MIN);
+    atomic_init(&pqueue->spinning, 0);
+    atomic_init(&pqueue->policy, QUEUE_STRICT_FIFO);
+    atomic_init(&pqueue->closed, false);
+    atomic_init(&pqueue->nonempty_levels, 0);
+    pqueue->prioritized = false;
+    atomic_init(&pqueue->aging, 0);
+    atomic_init(&pqueue->takes, 0);
+    // the list always holds at least one segment, so producers always have cells to claim (or a segment to link a new one to)
+    first = take_segment(&pqueue->pool);
+    atomic_init(&pqueue->front, TAGGED(first, seg_at(&pqueue->pool, first)->inc));
+    atomic_init(&pqueue->rear, TAGGED(first, seg_at(&pqueue->pool, first)->inc));
+    // Initializing th_queue and prod_queue
+    pqueue->th_queue.pfirst = NULL;
+    pqueue->th_queue.plast = NULL;
+    atomic_init(&pqueue->th_queue.waiting, 0);
+    pqueue->prod_queue.pfirst = NULL;
+    pqueue->prod_queue.plast = NULL;
+    atomic_init(&pqueue->prod_queue.waiting, 0);
+    pqueue->pwheel = NULL;
+    atomic_init(&pqueue->next_due, UINT64_MAX);
+    pqueue->ptags = NULL;
+    atomic_init(&pqueue->tagged, 0);
+    atomic_init(&pqueue->tag_waiting, 0);
+    atomic_init(&pqueue->blocked, 0);
+    // Initializing shards, they are plain unbounded queues, capacity and waiting threads are handled by this queue
+    pqueue->nshards = nshards;
+    pqueue->shards = NULL;
+    if(nshards > 0)
+    {
+        pqueue->shards = (Queue*)aligned_alloc(_Alignof(Queue), nshards * sizeof(Queue)); // No error checking since we assume aligned_alloc never fails
+        for(i = 0; i < nshards; i++)
+        {
+            init_queue(&pqueue->shards[i], 0, 0);
+        }
+    }
+}
+
+void init_priority_queue(Queue* pqueue, size_t nlevels)
+{
+    // the levels are sub-queues just like shards, only the way items are spread over them differs
+    nlevels = nlevels < 1 ? 1 : nlevels > MAX_LEVELS ? MAX_LEVELS : nlevels;
+    init_queue(pqueue, 0, nlevels);
+    pqueue->prioritized = true;
+}
+
+void fini_queue(Queue* pqueue)
+{
+    size_t i;
+    SegmentDir* pdir;
+    uint32_t nsegs;
+    TimerWheel* pwheel;
+    TagTable* ptags;
+    ThreadNode* pth;
+
+    // threads still parked in the queue would be left waiting on a destroyed mutex and cv, so it is closed first:
+    // waiting consumers get what is left or QUEUE_CLOSED, and waiting producers get no slot (their enqueue fails).
+    // It is only torn down once every one of them has let go of its mutex
+    LOCK_QUEUE(pqueue);
+    atomic_store(&pqueue->closed, true);
+    return_slots(pqueue, hand_items_to_waiters(pqueue));
+    wake_closed(pqueue);
+    while((pth = pqueue->prod_queue.pfirst) != NULL)
+    {
+        remove_first_th_node(&pqueue->prod_queue);
+        pth->pdata = QUEUE_CLOSED;
+        pth->delivered = true;
+        wake_later(pth);
+    }
+    UNLOCK_QUEUE(pqueue);
+    wake_pending();
+    while(atomic_load(&pqueue->blocked) > 0)
+    {
+        thrd_yield();
+    }
+
+    for(i = 0; i < pqueue->nshards; i++)
+    {
+        fini_queue(&pqueue->shards[i]);
+    }
+    free(pqueue->shards);
+    pqueue->shards = NULL;
+    pqueue->nshards = 0;
+    pqueue->prioritized = false;
+    atomic_store(&pqueue->nonempty_levels, 0);
+
+    // a deep queue has many segments, they are detached under the lock but freed after it is released
+    // so that destroying the queue holds the lock for the same short time whatever its depth
+    LOCK_QUEUE(pqueue);
+    pdir = detach_item_segments(pqueue, &nsegs);
+    pwheel = pqueue->pwheel;
+    pqueue->pwheel = NULL;
+    atomic_store(&pqueue->next_due, UINT64_MAX);
+    ptags = pqueue->ptags; // the threads waiting in its entries are dropped like those in th_queue
+    pqueue->ptags = NULL;
+    atomic_store(&pqueue->tagged, 0);
+    atomic_store(&pqueue->tag_waiting, 0);
+    detach_th_nodes(&pqueue->th_queue); // emptying th_queue
+    detach_th_nodes(&pqueue->prod_queue); // emptying prod_queue
+    atomic_store(&pqueue->size, 0);
+    atomic_store(&pqueue->visited, 0);
+    for(i = 0; i < TH_SLOTS; i++)
+    {
+        atomic_store(&pqueue->visited_stripes[i].count, 0);
+    }
+    atomic_store(&pqueue->reserved, 0);
+    atomic_store(&pqueue->th_queue.waiting, 0);
+    atomic_store(&pqueue->prod_queue.waiting, 0);
+
+    UNLOCK_QUEUE(pqueue);
+    free_segments(pdir, nsegs); // freeing all segments of queue
+    free_timer_wheel(pwheel); // and whatever was still scheduled
+    free_tag_table(ptags); // or tagged
+    mtx_destroy(&pqueue->mutex);
+}
+
+// -------- QUEUE INSTANCE FUNCTIONS IMPLEMENTATION ----------
+// Every queue_* function works on its own queue, the functions of the assignment below are wrappers around them for the global queue
+
+queue_t* queue_create(void)
+{
+    return queue_create_bounded(0);
+}
+
+queue_t* queue_create_bounded(size_t capacity)
+{
+    Queue* pqueue;
+
+    // Queue holds cache line aligned members, so plain malloc is not enough
+    pqueue = (Queue*)aligned_alloc(_Alignof(Queue), sizeof(Queue)); // No error checking since we assume aligned_alloc never fails
+    init_queue(pqueue, capacity, 0);
+    return pqueue;
+}
+
+queue_t* queue_create_sharded(size_t nshards)
+{
+    Queue* pqueue;
+
+    pqueue = (Queue*)aligned_alloc(_Alignof(Queue), sizeof(Queue)); // No error checking since we assume aligned_alloc never fails
+    init_queue(pqueue, 0, nshards);
+    return pqueue;
+}
+
+queue_t* queue_create_priority(size_t nlevels)
+{
+    Queue* pqueue;
+
+    pqueue = (Queue*)aligned_alloc(_Alignof(Queue), sizeof(Queue)); // No error checking since we assume aligned_alloc never fails
+    init_priority_queue(pqueue, nlevels);
+    return pqueue;
+}
+
+void queue_destroy(queue_t* pqueue)
+{
+    fini_queue(pqueue);
+    free(pqueue);
+}
+
+void queue_enqueue(queue_t* pqueue, void* pdata)
+{
+    // in bounded mode this waits for a free slot first, in priority mode the item goes to the lowest level
+    enqueue_reserved(pqueue, pdata, 0, NULL);
+}
+
+void queue_enqueue_priority(queue_t* pqueue, void* pdata, unsigned level)
+{
+    enqueue_reserved(pqueue, pdata, level, NULL);
+}
+
+void queue_enqueue_at(queue_t* pqueue, void* pdata, const struct timespec* when)
+{
+    enqueue_at(pqueue, pdata, timespec_to_ns(when));
+}
+
+void queue_enqueue_after(queue_t* pqueue, void* pdata, const struct timespec* delay)
+{
+    enqueue_at(pqueue, pdata, wall_ns() + timespec_to_ns(delay));
+}
+
+void queue_enqueue_tagged(queue_t* pqueue, void* pdata, uint32_t tag)
+{
+    enqueue_tagged(pqueue, pdata, tag);
+}
+
+bool queue_try_enqueue(queue_t* pqueue, void* pdata)
+{
+    if(pqueue->capacity > 0 &&
+       (atomic_load_explicit(&pqueue->prod_queue.waiting, memory_order_acquire) > 0 || try_reserve_slots(pqueue, 1) == 0)) // no free slot for us
+    {
+        return false;
+    }
+    push_items(pqueue, 0, &pdata, 1);
+    notify_waiters(pqueue);
+    return true;
+}
+
+bool queue_enqueue_timed(queue_t* pqueue, void* pdata, const struct timespec* deadline)
+{
+    return enqueue_reserved(pqueue, pdata, 0, deadline);
+}
+
+void queue_enqueue_many(queue_t* pqueue, void** items, size_t n)
+{
+    size_t count;
+
+    // the burst claims its cells with one CAS per segment it lands in, so it stays in order (though a burst that
+    // crosses into a new segment may be interleaved with other producers' items there), and the lock is taken at most once to hand the burst out to waiting threads in FIFO order.
+    // in bounded mode the burst goes in as pieces of whatever number of slots are free
+    while(n > 0)
+    {
+        count = pqueue->capacity > 0 ? reserve_slots(pqueue, n, NULL) : n;
+        if(count == 0) // the queue is being destroyed
+        {
+            return;
+        }
+        push_items(pqueue, 0, items, count);
+        notify_waiters(pqueue);
+        items += count;
+        n -= count;
+    }
+}
+
+void* queue_dequeue(queue_t* pqueue)
+{
+    void* pret_data = NULL;
+
+    dequeue_timed(pqueue, &pret_data, NULL);
+    return pret_data;
+}
+
+bool queue_dequeue_timed(queue_t* pqueue, void** returned_ptr, const struct timespec* deadline)
+{
+    return dequeue_timed(pqueue, returned_ptr, deadline);
+}
+
+void* queue_dequeue_tag(queue_t* pqueue, uint32_t tag)
+{
+    void* pret_data = NULL;
+
+    dequeue_tag(pqueue, tag, &pret_data, true);
+    return pret_data;
+}
+
+void* queue_dequeue_any(queue_t** pqueues, size_t n, size_t* pwhich)
+{
+    return dequeue_any(pqueues, n, pwhich);
+}
+
+bool queue_try_dequeue_tag(queue_t* pqueue, uint32_t tag, void** returned_ptr)
+{
+    *returned_ptr = NULL;
+    return dequeue_tag(pqueue, tag, returned_ptr, false);
+}
+
+bool queue_try_dequeue(queue_t* pqueue, void** returned_ptr)
+{
+    *returned_ptr = NULL; // so that a failed try never leaves whatever the caller had there
+    check_due_items(pqueue);
+    if(owed_to_waiters(pqueue))  // whatever is in the queue belongs to the waiting threads
+    {
+        return false;
+    }
+    if(take_items(pqueue, returned_ptr, 1) == 0)
+    {
+        if(atomic_load_explicit(&pqueue->closed, memory_order_relaxed))
+        {
+            *returned_ptr = QUEUE_CLOSED;
+        }
+        return false;
+    }
+    release_slots(pqueue, 1);
+    return true;
+}
+
+size_t queue_try_dequeue_many(queue_t* pqueue, void** out, size_t max)
+{
+    size_t n;
+
+    check_due_items(pqueue);
+    if(owed_to_waiters(pqueue))  // whatever is in the queue belongs to the waiting threads
+    {
+        return 0;
+    }
+    // all items are detached with a single CAS on the head of the first segment (one per segment and shard they span)
+    n = take_items(pqueue, out, max);
+    release_slots(pqueue, n);
+    return n;
+}
+
+size_t queue_dequeue_many(queue_t* pqueue, void** out, size_t max)
+{
+    if(max == 0)
+    {
+        return 0;
+    }
+    // blocking like dequeue until there is at least one item, then taking whatever else is there,
+    // unless threads that came after us are waiting too, in which case the rest is theirs
+    out[0] = queue_dequeue(pqueue);
+    if(out[0] == QUEUE_CLOSED)
+    {
+        return 0;
+    }
+    return 1 + queue_try_dequeue_many(pqueue, out + 1, max - 1);
+}
+
+size_t queue_size(queue_t* pqueue)
+{
+    return item_count(pqueue) + atomic_load_explicit(&pqueue->tagged, memory_order_relaxed);
+}
+
+size_t queue_waiting(queue_t* pqueue)
+{
+    return atomic_load_explicit(&pqueue->th_queue.waiting, memory_order_relaxed) +
+           atomic_load_explicit(&pqueue->tag_waiting, memory_order_relaxed);
+}
+
+size_t queue_visited(queue_t* pqueue)
+{
+    return count_visited(pqueue);
+}
+
+void queue_set_spin_limit(queue_t* pqueue, size_t max_spins)
+{
+    atomic_store_explicit(&pqueue->spin_limit, max_spins, memory_order_relaxed);
+}
+
+void queue_set_policy(queue_t* pqueue, queue_policy_t policy)
+{
+    atomic_store_explicit(&pqueue->policy, policy, memory_order_relaxed);
+}
+
+void queue_set_aging(queue_t* pqueue, size_t every)
+{
+    atomic_store_explicit(&pqueue->aging, every, memory_order_relaxed);
+}
+
+void queue_close(queue_t* pqueue)
+{
+    LOCK_QUEUE(pqueue);
+    atomic_store(&pqueue->closed, true);
+    // whatever is in the queue still goes to the oldest waiting threads, the others are woken empty handed
+    return_slots(pqueue, hand_items_to_waiters(pqueue));
+    wake_closed(pqueue);
+    UNLOCK_QUEUE(pqueue);
+    wake_pending();
+}
+
+void queue_stats_snapshot(queue_stats_t* pstats)
+{
+    memset(pstats, 0, sizeof(*pstats));
+#ifdef QUEUE_INSTRUMENT
+    queue_hist_t* hists[HIST_KINDS] = {&pstats->lock_wait, &pstats->lock_hold, &pstats->parked, &pstats->residency};
+    ThreadStats* pthread_stats;
+    uint64_t max_ns;
+    int kind;
+    unsigned i;
+
+    // summing every thread's histograms, threads keep recording meanwhile so the snapshot is not from a single instant.
+    // The lock only keeps exiting threads from freeing theirs under us
+    call_once(&stats_once, init_stats);
+    mtx_lock(&stats_mutex);
+    for(pthread_stats = all_stats; pthread_stats != NULL; pthread_stats = pthread_stats->pnext)
+    {
+        for(kind = 0; kind < HIST_KINDS; kind++)
+        {
+            hists[kind]->count += atomic_load_explicit(&pthread_stats->count[kind], memory_order_relaxed);
+            hists[kind]->total_ns += atomic_load_explicit(&pthread_stats->total_ns[kind], memory_order_relaxed);
+            max_ns = atomic_load_explicit(&pthread_stats->max_ns[kind], memory_order_relaxed);
+            if(max_ns > hists[kind]->max_ns)
+            {
+                hists[kind]->max_ns = max_ns;
+            }
+            for(i = 0; i < QUEUE_HIST_BUCKETS; i++)
+            {
+                hists[kind]->buckets[i] += atomic_load_explicit(&pthread_stats->buckets[kind][i], memory_order_relaxed);
+            }
+        }
+    }
+    mtx_unlock(&stats_mutex);
+#endif
+}
+
+uint64_t queue_hist_percentile(const queue_hist_t* phist, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    unsigned i;
+
+    if(phist->count == 0)
+    {
+        return 0;
+    }
+    // the value at the given rank is somewhere in its bucket, reporting the top of the bucket (capped by the max) like HDR does
+    rank = (uint64_t)(percentile / 100.0 * (double)phist->count + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    for(i = 0; i < QUEUE_HIST_BUCKETS; i++)
+    {
+        seen += phist->buckets[i];
+        if(seen >= rank)
+        {
+            if(i + 1 < QUEUE_HIST_BUCKETS && hist_bucket_low(i + 1) - 1 < phist->max_ns)
+            {
+                return hist_bucket_low(i + 1) - 1;
+            }
+            return phist->max_ns;
+        }
+    }
+    return phist->max_ns;
+}
+
+// -------- LIBRARY FUNCTIONS IMPLEMENTATION ----------
+
+void initQueue(void)
+{
+    init_queue(&queue, 0, 0);
+}
+
+void initQueueBounded(size_t capacity)
+{
+    init_queue(&queue, capacity, 0);
+}
+
+void initQueuePriority(size_t nlevels)
+{
+    init_priority_queue(&queue, nlevels);
+}
+
+void destroyQueue(void)
+{
+    fini_queue(&queue);
+}
+
+void enqueue(void* pdata)
+{
+    queue_enqueue(&queue, pdata);
+}
+
+void enqueuePriority(void* pdata, unsigned level)
+{
+    queue_enqueue_priority(&queue, pdata, level);
+}
+
+void enqueueAt(void* pdata, const struct timespec* when)
+{
+    queue_enqueue_at(&queue, pdata, when);
+}
+
+void enqueueAfter(void* pdata, const struct timespec* delay)
+{
+    queue_enqueue_after(&queue, pdata, delay);
+}
+
+void enqueueTagged(void* pdata, uint32_t tag)
+{
+    queue_enqueue_tagged(&queue, pdata, tag);
+}
+
+void* dequeueTag(uint32_t tag)
+{
+    return queue_dequeue_tag(&queue, tag);
+}
+
+bool tryDequeueTag(uint32_t tag, void** returned_ptr)
+{
+    return queue_try_dequeue_tag(&queue, tag, returned_ptr);
+}
+
+void* dequeueAny(queue_t** pqueues, size_t n, size_t* pwhich)
+{
+    return dequeue_any(pqueues, n, pwhich);
+}
+
+bool tryEnqueue(void* pdata)
+{
+    return queue_try_enqueue(&queue, pdata);
+}
+
+bool enqueueTimed(void* pdata, const struct timespec* deadline)
+{
+    return queue_enqueue_timed(&queue, pdata, deadline);
+}
+
+void enqueueMany(void** items, size_t n)
+{
+    queue_enqueue_many(&queue, items, n);
+}
+
+void* dequeue(void)
+{
+    return queue_dequeue(&queue);
+}
+
+bool dequeueTimed(void** returned_ptr, const struct timespec* deadline)
+{
+    return queue_dequeue_timed(&queue, returned_ptr, deadline);
+}
+
+bool tryDequeue(void** returned_ptr)
+{
+    return queue_try_dequeue(&queue, returned_ptr);
+}
+
+size_t tryDequeueMany(void** out, size_t max)
+{
+    return queue_try_dequeue_many(&queue, out, max);
+}
+
+size_t dequeueMany(void** out, size_t max)
+{
+    return queue_dequeue_many(&queue, out, max);
+}
+
+void setSpinLimit(size_t max_spins)
+{
+    queue_set_spin_limit(&queue, max_spins);
+}
+
+void setPolicy(queue_policy_t policy)
+{
+    queue_set_policy(&queue, policy);
+}
+
+void setAging(size_t every)
+{
+    queue_set_aging(&queue, every);
+}
+
+void closeQueue(void)
+{
+    queue_close(&queue);
 }
 
 size_t size(void)
 {
     /*Return the current amount of items in the queue.*/
-    return queue.size;
+    return queue_size(&queue);
 }
 
 size_t waiting(void)
 {
     /*Return the current amount of threads waiting for the queue to fill.*/
-    return th_queue.waiting;
+    return queue_waiting(&queue);
 }
 
 size_t visited(void)
@@ -307,5 +2797,5 @@ size_t visited(void)
     Return the amount of items that have passed inside the queue (i.e., inserted and then removed).
     This should not block due to concurrent operations, i.e., you may not take a lock at all.
     */
-   return queue.visited;
+   return queue_visited(&queue);
 }
@@ -1,11 +1,106 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
 void initQueue(void);
+void initQueueBounded(size_t);
+void initQueuePriority(size_t);
 void destroyQueue(void);
 void enqueue(void*);
+void enqueuePriority(void*, unsigned);
+// Scheduled items: the item is enqueued once the TIME_UTC time when has come (enqueueAt) or delay has passed
+// (enqueueAfter), with a resolution of 1 ms. Until then it is not counted by size and no dequeue sees it
+void enqueueAt(void*, const struct timespec*);
+void enqueueAfter(void*, const struct timespec*);
+// Tagged items: an item enqueued with a tag is only seen by dequeueTag / tryDequeueTag of the same tag (and not by
+// dequeue), items of a tag come out in FIFO order, and an enqueue only wakes a thread waiting for its tag
+void enqueueTagged(void*, uint32_t);
+void* dequeueTag(uint32_t);
+bool tryDequeueTag(uint32_t, void**);
+bool tryEnqueue(void*);
+bool enqueueTimed(void*, const struct timespec*);
+void enqueueMany(void**, size_t);
 void* dequeue(void);
+bool dequeueTimed(void**, const struct timespec*);
 bool tryDequeue(void**);
+size_t dequeueMany(void**, size_t);
+size_t tryDequeueMany(void**, size_t);
+void setSpinLimit(size_t);
+// What happens to an item that arrives while consumers are parked. QUEUE_STRICT_FIFO (the default) hands it to the
+// oldest parked consumer, QUEUE_BARGING leaves it to a consumer that is running and only wakes a parked one if none is,
+// which saves wakeups under load but lets running consumers overtake parked ones
+typedef enum queue_policy { QUEUE_STRICT_FIFO, QUEUE_BARGING } queue_policy_t;
+void setPolicy(queue_policy_t);
+// Priority mode (initQueuePriority / queue_create_priority with up to 64 levels): dequeue takes from the highest level
+// that holds items, FIFO within a level, and enqueue puts items at level 0. With aging set to n, every n-th dequeue
+// goes to a lower level instead (the levels take turns), so low levels can't starve. 0 (the default) turns aging off
+void setAging(size_t);
+// Shutdown: closeQueue wakes every thread waiting in dequeue (or dequeueTag, dequeueAny) at once. Items still in the queue
+// are handed out as usual, and once it is empty dequeue returns QUEUE_CLOSED instead of blocking (dequeueTimed and tryDequeue
+// return false and store QUEUE_CLOSED, dequeueMany returns 0). Scheduled items that aren't due yet don't count, and items
+// enqueued after closeQueue are still dequeued, but nobody waits for them. destroyQueue closes the queue first and waits
+// for the threads parked in it to return, producers blocked for a slot of a bounded queue give up without enqueueing
+extern void* const QUEUE_CLOSED;
+void closeQueue(void);
+// Statistics, they never block and never take a lock, so they can be polled at any rate. size and waiting read whole atomic
+// counters (summed over the shards of a sharded queue), so they are never torn, but they are a snapshot that may be stale
+// as soon as they return: size may already count items whose enqueue hasn't returned yet. visited is summed over per-thread
+// stripes when it is read, so it is not a single load or a consistent snapshot and may be slightly stale while producers and
+// consumers are running. It never goes down and is exact once no dequeue is running
 size_t size(void);
 size_t waiting(void);
 size_t visited(void);
+
+// Independent queues, the functions above work on a single global queue
+typedef struct Queue queue_t;
+queue_t* queue_create(void);
+queue_t* queue_create_bounded(size_t);
+queue_t* queue_create_sharded(size_t);
+queue_t* queue_create_priority(size_t);
+void queue_destroy(queue_t*);
+void queue_enqueue(queue_t*, void*);
+void queue_enqueue_priority(queue_t*, void*, unsigned);
+void queue_enqueue_at(queue_t*, void*, const struct timespec*);
+void queue_enqueue_after(queue_t*, void*, const struct timespec*);
+void queue_enqueue_tagged(queue_t*, void*, uint32_t);
+bool queue_try_enqueue(queue_t*, void*);
+bool queue_enqueue_timed(queue_t*, void*, const struct timespec*);
+void queue_enqueue_many(queue_t*, void**, size_t);
+void* queue_dequeue(queue_t*);
+bool queue_dequeue_timed(queue_t*, void**, const struct timespec*);
+bool queue_try_dequeue(queue_t*, void**);
+size_t queue_dequeue_many(queue_t*, void**, size_t);
+size_t queue_try_dequeue_many(queue_t*, void**, size_t);
+void* queue_dequeue_tag(queue_t*, uint32_t);
+bool queue_try_dequeue_tag(queue_t*, uint32_t, void**);
+// Waiting on several queues at once: takes an item from whichever of the n queues has one first (the first of them in
+// array order if several already do) and stores that queue's index in *which. The thread waits in every queue like a
+// dequeue does, and exactly one of the queues hands it an item, the others keep theirs
+void* queue_dequeue_any(queue_t**, size_t, size_t*);
+void* dequeueAny(queue_t**, size_t, size_t*);
+void queue_set_spin_limit(queue_t*, size_t);
+void queue_set_policy(queue_t*, queue_policy_t);
+void queue_set_aging(queue_t*, size_t);
+void queue_close(queue_t*);
+size_t queue_size(queue_t*);
+size_t queue_waiting(queue_t*);
+size_t queue_visited(queue_t*);
+
+// Latency histograms (in ns), only filled in when queue.c is compiled with -DQUEUE_INSTRUMENT, all zero otherwise.
+// Buckets are log-linear like HDR histograms, with 2^QUEUE_HIST_SUB_BITS buckets for every power of two
+#define QUEUE_HIST_SUB_BITS 3
+#define QUEUE_HIST_BUCKETS ((64 - QUEUE_HIST_SUB_BITS + 1) << QUEUE_HIST_SUB_BITS)
+typedef struct queue_hist {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[QUEUE_HIST_BUCKETS];
+} queue_hist_t;
+typedef struct queue_stats {
+    queue_hist_t lock_wait; // waiting to get a queue's mutex (or the one a thread in dequeueAny parks on)
+    queue_hist_t lock_hold; // holding one of those, not counting time parked
+    queue_hist_t parked; // parked in cnd_wait / cnd_timedwait
+    queue_hist_t residency; // from an item's enqueue to its dequeue
+} queue_stats_t;
+void queue_stats_snapshot(queue_stats_t*); // sums up the histograms of all threads and queues
+uint64_t queue_hist_percentile(const queue_hist_t*, double); // percentile is in [0, 100]
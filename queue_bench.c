@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "queue.h"
+
+// Throughput and latency benchmark for any implementation of the queue.h functions of the assignment
+// (initQueue, destroyQueue, enqueue, dequeue), so queue.c, dont_touch.c, monet1.c and monet2.c can be compared.
+// Runs a matrix of producer/consumer counts, steady or bursty producers, and an empty or a deep queue,
+// and prints one CSV row per run with ops/sec and the p50/p99/p999 enqueue-to-dequeue latency.
+// A run that hands out items it was never given, or doesn't finish within RUN_TIMEOUT_S, ends the benchmark with
+// a row whose status says so, since its threads can't be stopped.
+//
+// usage: queue_bench [label] [max_producers] [max_consumers] [items_per_run] [repetitions]
+//
+// Built with -DQUEUE_BENCH_COMPARE it is linked against all four implementations at once, each renamed to
+// cmp_<impl>_<function> by compare_queues.sh, and the first argument picks the implementation to run instead.
+
+#define DEFAULT_MAX_THREADS 4
+#define DEFAULT_ITEMS 200000L
+#define DEFAULT_REPETITIONS 3
+#define BURST_SIZE 256 // a bursty producer enqueues this many items back to back, then pauses
+#define BURST_PAUSE_NS 50000
+#define DEEP_QUEUE_ITEMS 100000 // items already in the queue when a deep queue run starts
+#define RUN_TIMEOUT_S 60
+
+// The functions of the implementation under test
+typedef struct QueueImpl {
+    const char *name;
+    void (*init)(void);
+    void (*destroy)(void);
+    void (*enqueue)(void *);
+    void *(*dequeue)(void);
+} QueueImpl;
+
+#ifdef QUEUE_BENCH_COMPARE
+#define DECLARE_IMPL(prefix) \
+    void cmp_##prefix##_initQueue(void); \
+    void cmp_##prefix##_destroyQueue(void); \
+    void cmp_##prefix##_enqueue(void *); \
+    void *cmp_##prefix##_dequeue(void);
+#define IMPL(prefix) {#prefix, cmp_##prefix##_initQueue, cmp_##prefix##_destroyQueue, cmp_##prefix##_enqueue, cmp_##prefix##_dequeue}
+DECLARE_IMPL(queue)
+DECLARE_IMPL(dont_touch)
+DECLARE_IMPL(monet1)
+DECLARE_IMPL(monet2)
+static const QueueImpl impls[] = {IMPL(queue), IMPL(dont_touch), IMPL(monet1), IMPL(monet2)};
+#else
+static const QueueImpl impls[] = {{"queue", initQueue, destroyQueue, enqueue, dequeue}};
+#endif
+
+typedef struct Run {
+    int producers;
+    int consumers;
+    bool bursty;
+    bool deep;
+    long items; // items enqueued by the producers, not counting the deep queue prefill
+} Run;
+
+// Every item is a pointer to its own slot in this array, holding the time it was enqueued
+static _Atomic uint64_t *enqueue_times;
+static uint64_t *latencies; // one per dequeued item, filled by the consumers
+static atomic_long next_latency;
+static atomic_long wrong_items; // dequeued items that are not one of ours
+static atomic_int finished_consumers;
+static atomic_int ready_threads;
+static atomic_bool go;
+static Run run;
+static const QueueImpl *impl;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Helper function to start all threads of a run at the same moment
+void wait_for_start(void) {
+    atomic_fetch_add(&ready_threads, 1);
+    while (!atomic_load(&go)) {
+        thrd_yield();
+    }
+}
+
+// Helper function to split count as evenly as possible between parts, returns part i's share
+long share(long count, int parts, int i) {
+    return count / parts + (i < count % parts ? 1 : 0);
+}
+
+int producer(void *arg) {
+    int id = (int)(long)arg;
+    long first = DEEP_QUEUE_ITEMS * run.deep;
+    for (int i = 0; i < id; ++i) {
+        first += share(run.items, run.producers, i);
+    }
+    long count = share(run.items, run.producers, id);
+
+    wait_for_start();
+    for (long i = 0; i < count; ++i) {
+        atomic_store_explicit(&enqueue_times[first + i], now_ns(), memory_order_relaxed);
+        impl->enqueue((void *)&enqueue_times[first + i]);
+        if (run.bursty && (i + 1) % BURST_SIZE == 0) {
+            thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = BURST_PAUSE_NS}, NULL);
+        }
+    }
+    return 0;
+}
+
+int consumer(void *arg) {
+    long count = (long)arg;
+    wait_for_start();
+    for (long i = 0; i < count; ++i) {
+        _Atomic uint64_t *item = (_Atomic uint64_t *)impl->dequeue();
+        if (item < enqueue_times || item >= enqueue_times + run.items + DEEP_QUEUE_ITEMS) {
+            atomic_fetch_add(&wrong_items, 1);
+            continue;
+        }
+        uint64_t latency = now_ns() - atomic_load_explicit(item, memory_order_relaxed);
+        latencies[atomic_fetch_add_explicit(&next_latency, 1, memory_order_relaxed)] = latency;
+    }
+    atomic_fetch_add(&finished_consumers, 1);
+    return 0;
+}
+
+int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(const uint64_t *sorted, long count, double p) {
+    long rank = (long)(p / 100.0 * count + 0.5);
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    return sorted[rank - 1];
+}
+
+// Helper function to print the CSV row of a run, latencies must hold count sorted values
+void print_row(const char *label, int repetition, long total, double seconds, long count, const char *status) {
+    printf("%s,%d,%d,%s,%s,%ld,%d,%.6f,%.0f,%llu,%llu,%llu,%llu,%s\n", label, run.producers, run.consumers,
+           run.bursty ? "burst" : "steady", run.deep ? "deep" : "empty", total, repetition, seconds, count / seconds,
+           (unsigned long long)(count > 0 ? percentile(latencies, count, 50.0) : 0),
+           (unsigned long long)(count > 0 ? percentile(latencies, count, 99.0) : 0),
+           (unsigned long long)(count > 0 ? percentile(latencies, count, 99.9) : 0),
+           (unsigned long long)(count > 0 ? latencies[count - 1] : 0), status);
+    fflush(stdout);
+}
+
+// Function to do a single run and print its CSV row
+void do_run(const char *label, int repetition) {
+    long total = run.items + DEEP_QUEUE_ITEMS * run.deep;
+    thrd_t producers[run.producers];
+    thrd_t consumers[run.consumers];
+
+    impl->init();
+    atomic_store(&next_latency, 0);
+    atomic_store(&wrong_items, 0);
+    atomic_store(&finished_consumers, 0);
+    atomic_store(&ready_threads, 0);
+    atomic_store(&go, false);
+    // in a deep queue run the consumers start with a backlog, and the prefilled items are timed from the start of the run
+    for (long i = 0; i < DEEP_QUEUE_ITEMS * run.deep; ++i) {
+        impl->enqueue((void *)&enqueue_times[i]);
+    }
+    for (int i = 0; i < run.consumers; ++i) {
+        thrd_create(&consumers[i], consumer, (void *)share(total, run.consumers, i));
+    }
+    for (int i = 0; i < run.producers; ++i) {
+        thrd_create(&producers[i], producer, (void *)(long)i);
+    }
+    while (atomic_load(&ready_threads) < run.producers + run.consumers) {
+        thrd_yield();
+    }
+    uint64_t start = now_ns();
+    for (long i = 0; i < DEEP_QUEUE_ITEMS * run.deep; ++i) {
+        atomic_store_explicit(&enqueue_times[i], start, memory_order_relaxed);
+    }
+    atomic_store(&go, true);
+    while (atomic_load(&finished_consumers) < run.consumers) {
+        if (now_ns() - start > RUN_TIMEOUT_S * 1000000000ull) {
+            print_row(label, repetition, total, (now_ns() - start) / 1e9, 0, "timeout");
+            exit(1);
+        }
+        thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 1000000}, NULL);
+    }
+    for (int i = 0; i < run.producers; ++i) {
+        thrd_join(producers[i], NULL);
+    }
+    for (int i = 0; i < run.consumers; ++i) {
+        thrd_join(consumers[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    impl->destroy();
+
+    long count = atomic_load(&next_latency);
+    qsort(latencies, count, sizeof(*latencies), compare_latencies);
+    if (atomic_load(&wrong_items) > 0) {
+        print_row(label, repetition, total, seconds, count, "wrong_items");
+        exit(1);
+    }
+    print_row(label, repetition, total, seconds, count, "ok");
+}
+
+int main(int argc, char *argv[]) {
+    const char *label = argc > 1 ? argv[1] : "queue";
+#ifdef QUEUE_BENCH_COMPARE
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (strcmp(impls[i].name, label) == 0) {
+            impl = &impls[i];
+        }
+    }
+    if (impl == NULL) {
+        fprintf(stderr, "unknown implementation %s\n", label);
+        return 1;
+    }
+#else
+    impl = &impls[0];
+#endif
+    int max_producers = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+    int max_consumers = argc > 3 ? atoi(argv[3]) : DEFAULT_MAX_THREADS;
+    long items = argc > 4 ? atol(argv[4]) : DEFAULT_ITEMS;
+    int repetitions = argc > 5 ? atoi(argv[5]) : DEFAULT_REPETITIONS;
+
+    enqueue_times = calloc(items + DEEP_QUEUE_ITEMS, sizeof(*enqueue_times));
+    latencies = calloc(items + DEEP_QUEUE_ITEMS, sizeof(*latencies));
+
+    printf("impl,producers,consumers,pattern,queue,items,repetition,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns,status\n");
+    // thread counts double from 1 up to the max (and the max itself)
+    for (int producers = 1; producers <= max_producers; producers = producers * 2 > max_producers && producers < max_producers ? max_producers : producers * 2) {
+        for (int consumers = 1; consumers <= max_consumers; consumers = consumers * 2 > max_consumers && consumers < max_consumers ? max_consumers : consumers * 2) {
+            for (int bursty = 0; bursty <= 1; ++bursty) {
+                for (int deep = 0; deep <= 1; ++deep) {
+                    run = (Run){.producers = producers, .consumers = consumers, .bursty = bursty, .deep = deep, .items = items};
+                    for (int repetition = 1; repetition <= repetitions; ++repetition) {
+                        do_run(label, repetition);
+                    }
+                }
+            }
+        }
+    }
+
+    free(enqueue_times);
+    free(latencies);
+    return 0;
+}